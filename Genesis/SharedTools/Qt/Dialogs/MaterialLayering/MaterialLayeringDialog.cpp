@@ -22,13 +22,22 @@
 
 // QT Includes
 #include <SharedTools/Qt/QtSharedIncludesBegin.h>
+#include <QtCore/QCryptographicHash>
+#include <QtCore/QDataStream>
+#include <QtCore/QDir>
+#include <QtCore/QFile>
+#include <QtCore/QHash>
+#include <QtCore/QMutex>
 #include <QtCore/QSettings>
+#include <QtCore/QStandardPaths>
 #include <QtCore/QTextStream>
+#include <QtCore/QWaitCondition>
 #include <QtWidgets/QFileDialog>
 #include <QtWidgets/QInputDialog>
 #include <QtWidgets/QMenu>
 #include <QtWidgets/QMessageBox>
 #include <QtWidgets/QProgressDialog>
+#include <QtWidgets/QScrollBar>
 #include <QtWidgets/QToolBar>
 #include <SharedTools/Qt/QtSharedIncludesEnd.h>
 // \ QT Includes
@@ -109,6 +118,9 @@ namespace
 	const char* pUntitledMaterialDataParentC = "1LayerStandard";
 	constexpr int32_t MaterialPreviewRefreshTimerC = 2000;	// Seconds between refreshing, to allow reloaded textures to show up etc
 	constexpr int32_t UpdateTickC = 30;
+	constexpr int32_t PropertyEditGestureWindowC = 500;		// Milliseconds between edits of a property merged into one undo step.
+	constexpr int32_t PropertyChangeNotifyIntervalC = 50;	// Minimum milliseconds between two property change notifications.
+	constexpr uint32_t SaveAllShardSizeC = 32;				// Materials saved by Save All between two progress updates, unless a family of data parents and children holds more.
 
 	const QString SplitterPreviewAndBrowserC("splitterPreviewAndBrowser");
 	const QString SplitterMainVerticalC("splitterMainVertical");
@@ -181,13 +193,9 @@ namespace
 	void FillMaterialHierarchy(QTreeWidget* apTreeWidget, const QString& aRootNodeLabel, BSMaterial::LayeredMaterialID aEditedMaterialID, bool aShowAll, bool aRemoveEditedMaterialHierarchy = false)
 	{
 		QList<QTreeWidgetItem*> items;
-		stl::scrap_unordered_map<BSFixedString, BSFixedString> shaderModelDisplayNameMap;
 		stl::scrap_unordered_map<uint32_t, QTreeWidgetItem*> IDtoItemMap; // Map for tracking which ID is associated with which QTreeWidgetItem
 		const uint32_t rootLevelID = BSMaterial::Internal::QRootLayeredMaterialsID().QValue();
 
-		//Get the DisplayName Map to use instead of actual ShaderModel data name.
-		SharedTools::GetShaderModelDisplayNameMap(shaderModelDisplayNameMap);
-
 		// Do we opt to cut out the edited item family tree from hierarchy (example : to choose a different root material parent).
 		BSFixedString shaderModelToRemove;
 		if (aRemoveEditedMaterialHierarchy)
@@ -212,10 +220,8 @@ namespace
 			pselectedItem = prootNode;
 		}
 
-		stl::vector<std::string> shaderModels = SharedTools::GetShaderModelTemplateList();
-
 		// Add all DB Materials
-		BSMaterial::ForEachLayeredMaterial([&items, apTreeWidget, &IDtoItemMap, &shaderModelDisplayNameMap, rootLevelID, aEditedMaterialID, &pselectedItem, &shaderModels, aShowAll, &shaderModelToRemove](BSMaterial::LayeredMaterialID aParentID, BSMaterial::LayeredMaterialID aLayeredMaterialID)
+		BSMaterial::ForEachLayeredMaterial([&items, apTreeWidget, &IDtoItemMap, rootLevelID, aEditedMaterialID, &pselectedItem, aShowAll, &shaderModelToRemove](BSMaterial::LayeredMaterialID aParentID, BSMaterial::LayeredMaterialID aLayeredMaterialID)
 		{
 			// Query the name of the layered material from the DB
 			BSFixedString name;
@@ -246,7 +252,7 @@ namespace
 				addMaterial = false;
 
 				// We only add the material if it corresponds to a shader model, and the shader model is not locked down.
-				if (isRootMaterial && std::find(shaderModels.begin(), shaderModels.end(), shaderModelName.QString()) != shaderModels.end())
+				if (isRootMaterial && SharedTools::IsShaderModel(shaderModelName))
 				{
 					// Check if this shader model is locked, if so, we prevent making new material from it.
 					addMaterial = !SharedTools::GetShaderModelLocked(shaderModelName);
@@ -268,7 +274,7 @@ namespace
 				}
 
 				// If we display only the shader models, use this display name instead of root material name
-				const BSFixedString& shaderModelDisplayName = shaderModelDisplayNameMap[shaderModelName];
+				const BSFixedString shaderModelDisplayName = SharedTools::GetShaderModelDisplayName(shaderModelName);
 
 				// Are we showing all the hierarchy or only the shader model names
 				QStringList nodeName;
@@ -535,6 +541,185 @@ namespace
 		restoreLayerSettings();
 	}
 
+	/// <summary> Estimate the memory held by a property value. </summary>
+	/// <param name="aValue"> The property value. </param>
+	/// <returns> Approximate size in bytes. </returns>
+	size_t EstimateVariantMemory(const QVariant& aValue)
+	{
+		size_t size = sizeof(QVariant);
+		if (aValue.type() == QVariant::String)
+		{
+			size += aValue.toString().size() * sizeof(QChar);
+		}
+		else if (aValue.type() == QVariant::ByteArray)
+		{
+			size += aValue.toByteArray().size();
+		}
+		else if (aValue.type() == QVariant::StringList || aValue.type() == QVariant::List)
+		{
+			for (const QVariant& rvalue : aValue.toList())
+			{
+				size += EstimateVariantMemory(rvalue);
+			}
+		}
+		return size;
+	}
+
+	/// <summary>
+	/// Undo command of a property editor change. Changes of the same property following each other within PropertyEditGestureWindowC,
+	/// such as dragging a slider or color picker, are merged into a single command spanning the whole gesture.
+	/// </summary>
+	class PropertyEditUndoCommand : public MaterialLayeringHistoryCommand
+	{
+	public:
+		using CommandFactory = stl::unique_function<QtPropertyEditor::UndoCommand*(const QVariant&, const QVariant&)>;
+		using AppliedCallback = stl::unique_function<void(const QString&, const QVariant&)>;
+		static constexpr int32_t IdC = 0x4d4c5045;	// 'MLPE'
+
+		/// <summary> Constructor </summary>
+		/// <param name="aDataPath"> Data path of the changed property. </param>
+		/// <param name="aPreviousValue"> Value of the property before the change. </param>
+		/// <param name="aNewValue"> Value of the property after the change. </param>
+		/// <param name="aFactory"> Creates the property editor command changing the property between two values. </param>
+		/// <param name="aApplied"> Called with the data path and applied value after each undo or redo, not when the change is first pushed. </param>
+		PropertyEditUndoCommand(const QString& aDataPath, const QVariant& aPreviousValue, const QVariant& aNewValue, CommandFactory&& aFactory, AppliedCallback&& aApplied) :
+			DataPath(aDataPath),
+			PreviousValue(aPreviousValue),
+			NewValue(aNewValue),
+			Factory(std::move(aFactory)),
+			Applied(std::move(aApplied)),
+			LastEdit(std::chrono::steady_clock::now())
+		{
+			spCommand.reset(Factory(PreviousValue, NewValue));
+			setText(spCommand->text());
+		}
+
+		int32_t id() const override { return IdC; }
+
+		void undo() override
+		{
+			if (!Restacking)
+			{
+				spCommand->undo();
+				Applied(DataPath, PreviousValue);
+			}
+		}
+
+		void redo() override
+		{
+			// The first redo happens on push, after the property editor applied the change itself.
+			if (!Restacking && Pushed)
+			{
+				spCommand->redo();
+				Applied(DataPath, NewValue);
+			}
+			Pushed = true;
+		}
+
+		/// <summary> The property editor command holds its own copy of both values. </summary>
+		size_t QPayloadSize() const override
+		{
+			return sizeof(PropertyEditUndoCommand) + sizeof(QtPropertyEditor::UndoCommand) + DataPath.size() * sizeof(QChar) + 2 * (EstimateVariantMemory(PreviousValue) + EstimateVariantMemory(NewValue));
+		}
+
+		MaterialLayeringHistoryCommand* Detach() override
+		{
+			PropertyEditUndoCommand* pcommand = new PropertyEditUndoCommand(DataPath, PreviousValue, NewValue, std::move(Factory), std::move(Applied));
+			pcommand->spCommand = std::move(spCommand);
+			pcommand->Pushed = Pushed;
+			pcommand->LastEdit = LastEdit;
+			return pcommand;
+		}
+
+		/// <summary> Absorb the next change of the same property if it belongs to the same gesture. </summary>
+		/// <param name="apOther"> The command pushed after this one, already applied. </param>
+		/// <returns> True if the command was merged. </returns>
+		bool mergeWith(const QUndoCommand* apOther) override
+		{
+			bool merged = false;
+
+			const PropertyEditUndoCommand* pother = static_cast<const PropertyEditUndoCommand*>(apOther);
+			if (!pother->Restacking && pother->DataPath == DataPath && pother->LastEdit - LastEdit < std::chrono::milliseconds(PropertyEditGestureWindowC))
+			{
+				// Going from the value before the gesture straight to the last value of the gesture.
+				NewValue = pother->NewValue;
+				LastEdit = pother->LastEdit;
+				spCommand.reset(Factory(PreviousValue, NewValue));
+				merged = true;
+			}
+
+			return merged;
+		}
+
+	private:
+		const QString DataPath;
+		const QVariant PreviousValue;
+		QVariant NewValue;
+		CommandFactory Factory;
+		AppliedCallback Applied;
+		std::unique_ptr<QtPropertyEditor::UndoCommand> spCommand;
+		bool Pushed = false;
+		std::chrono::steady_clock::time_point LastEdit;	// Time of the last change merged into this command.
+	};
+
+	/// <summary>
+	/// Drop the oldest commands of a history. QUndoStack cannot remove commands from its bottom, so the kept commands are moved
+	/// into new ones and pushed again on the cleared stack, without applying them, keeping the current and clean indices.
+	/// </summary>
+	/// <param name="arStack"> The history of a material, holding only MaterialLayeringHistoryCommand. </param>
+	/// <param name="aFirstKept"> Index of the oldest command kept, not above the current index. </param>
+	void TrimUndoHistory(QUndoStack& arStack, int32_t aFirstKept)
+	{
+		BSASSERT(aFirstKept <= arStack.index(), "Trimming commands that can be redone");
+		const int32_t index = arStack.index() - aFirstKept;
+		const int32_t cleanIndex = arStack.cleanIndex() - aFirstKept;
+
+		stl::vector<MaterialLayeringHistoryCommand*> kept;
+		for (int32_t i = aFirstKept; i < arStack.count(); i++)
+		{
+			kept.push_back(static_cast<MaterialLayeringHistoryCommand*>(const_cast<QUndoCommand*>(arStack.command(i)))->Detach());
+		}
+
+		// The material does not change, listeners of the history are not notified.
+		const QSignalBlocker block(&arStack);
+		arStack.clear();
+		for (int32_t i = 0; i < static_cast<int32_t>(kept.size()); i++)
+		{
+			if (i == cleanIndex)
+			{
+				arStack.setClean();
+			}
+			kept[i]->SetRestacking(true);
+			arStack.push(kept[i]);
+		}
+
+		if (cleanIndex == static_cast<int32_t>(kept.size()))
+		{
+			arStack.setClean();
+		}
+		else if (cleanIndex < 0)
+		{
+			// The saved state was trimmed, it can no longer be reached.
+			arStack.resetClean();
+		}
+		arStack.setIndex(index);
+
+		for (MaterialLayeringHistoryCommand* pcommand : kept)
+		{
+			pcommand->SetRestacking(false);
+		}
+	}
+
+	/// <summary> Find the layered material owning a material DB object. </summary>
+	/// <param name="aObject"> A layered material or one of its layers, blenders or other sub objects. </param>
+	/// <returns> The layered material of the file holding aObject, aObject itself if it has no file. </returns>
+	BSMaterial::LayeredMaterialID FindOwningLayeredMaterial(BSComponentDB2::ID aObject)
+	{
+		BSFilePathString file;
+		BSMaterial::Internal::QDBStorage().GetObjectFilename(aObject, file);
+		return file.QEmpty() ? BSMaterial::LayeredMaterialID(aObject) : BSMaterial::FindLayeredMaterialByFile(file.QString());
+	}
+
 	/// <summary>
 	/// This model allows the property select dialog to select material properties from the BSMaterialBinding::Bindings enum and Material instance data.
 	/// </summary>
@@ -608,7 +793,28 @@ namespace
 		MaterialPropertySelectModel(const BSMaterial::LayeredMaterialID aLayeredMaterialID) :
 			LayeredMaterialID(aLayeredMaterialID)
 		{
+			BuildProperties();
+			// The layers and UV streams of the material can change from anywhere, a LOD or another tool included.
+			MaterialChangeListener = BSMaterial::MaterialChangeNotifyService::QInstance().AddListener([this](BSComponentDB2::ID aObject)
+			{
+				if (FindOwningLayeredMaterial(aObject) == LayeredMaterialID)
+				{
+					Invalidate();
+				}
+			});
+		}
+
+		~MaterialPropertySelectModel()
+		{
+			BSMaterial::MaterialChangeNotifyService::QInstance().RemoveListener(MaterialChangeListener);
+		}
 
+		/// <summary>
+		/// Forget the selectable properties, they are rebuilt on the next query. Called when an object of the material changed.
+		/// </summary>
+		void Invalidate()
+		{
+			PropertiesValid = false;
 		}
 
 		/// <summary>
@@ -622,42 +828,17 @@ namespace
 		{
 			BSBind::INode* pnode = nullptr;
 
-			uint32_t totalIndex = 0;
-			for (uint32_t i = 0; i < static_cast<uint32_t>(BSMaterialBinding::Bindings::Count) && pnode == nullptr; i++)
+			const stl::vector<SelectableProperty>& rproperties = QProperties();
+			if (aIndex < rproperties.size())
 			{
-				const BSMaterialBinding::Bindings binding = static_cast<BSMaterialBinding::Bindings>(i);
-				for (uint16_t layerIndex = 0; layerIndex < BSMaterialBinding::GetBindingSupportedLayerCount(binding); layerIndex++)
+				const SelectableProperty& rproperty = rproperties[aIndex];
+				if (rproperty.UVStream.QValid())
 				{
-					if (GetLayer(LayeredMaterialID, layerIndex) != BSMaterial::NullIDC)
-					{
-						if (aIndex == totalIndex)
-						{
-							pnode = new BSMaterialBinding::MaterialPropertyNode(aName, apParent, static_cast<BSMaterialBinding::Bindings>(i), layerIndex);
-							break;
-						}
-						totalIndex++;
-					}
+					pnode = new BSMaterialBinding::MaterialUVStreamPropertyNode(aName, apParent, rproperty.UVStream, rproperty.UVBinding);
 				}
-			}
-
-			if (pnode == nullptr)
-			{
-				const BSScrapArray<BSMaterial::UVStreamID> uvStreams = CollectUVStreams(LayeredMaterialID);
-				for (uint32_t streamIndex = 0; streamIndex < uvStreams.QSize() && pnode == nullptr; streamIndex++)
+				else
 				{
-					const BSMaterial::UVStreamID streamID = uvStreams[streamIndex];
-
-					for (uint32_t i = 0; i < static_cast<uint32_t>(BSMaterialBinding::UVStreamBindingType::Count); i++)
-					{
-						const BSMaterialBinding::UVStreamBindingType binding = static_cast<BSMaterialBinding::UVStreamBindingType>(i);
-
-						if (aIndex == totalIndex)
-						{
-							pnode = new BSMaterialBinding::MaterialUVStreamPropertyNode(aName, apParent, streamID, binding);
-							break;
-						}
-						totalIndex++;
-					}
+					pnode = new BSMaterialBinding::MaterialPropertyNode(aName, apParent, rproperty.Binding, rproperty.LayerIndex);
 				}
 			}
 
@@ -672,28 +853,81 @@ namespace
 		BSContainer::ForEachResult ForEachProperty(const ForEachFunctor& aForEach) override
 		{
 			BSContainer::ForEachResult result = BSContainer::Continue;
-			for (uint32_t i = 0; i < static_cast<uint32_t>(BSMaterialBinding::Bindings::Count) && result != BSContainer::Stop; i++)
+
+			const stl::vector<SelectableProperty>& rproperties = QProperties();
+			for (uint32_t i = 0; i < rproperties.size() && result != BSContainer::Stop; i++)
+			{
+				result = aForEach(rproperties[i].DisplayName.QString());
+			}
+
+			return result;
+		}
+
+		/// <summary>
+		/// Is our index value a valid binding?
+		/// </summary>
+		/// <param name="aIndex"> Our index value</param>
+		/// <returns> If our index is valid </returns>
+		bool IsIndexValid(uint32_t aIndex) const override
+		{
+			return aIndex < QProperties().size();
+		}
+
+	private:
+		/// <summary> A selectable property, either a material binding of a layer or a binding of a UV stream. </summary>
+		struct SelectableProperty
+		{
+			BSMaterialBinding::Bindings Binding = BSMaterialBinding::Bindings::Count;
+			uint16_t LayerIndex = 0;
+			BSMaterial::UVStreamID UVStream;		// Valid for UV stream bindings only.
+			BSMaterialBinding::UVStreamBindingType UVBinding = BSMaterialBinding::UVStreamBindingType::Count;
+			BSString DisplayName;
+		};
+
+		/// <summary> Get the selectable properties, rebuilt if the layers or UV streams changed since they were built. </summary>
+		/// <returns> The properties in index order. </returns>
+		const stl::vector<SelectableProperty>& QProperties() const
+		{
+			if (!PropertiesValid)
+			{
+				BuildProperties();
+			}
+
+			return Properties;
+		}
+
+		/// <summary>
+		/// Enumerate once the material bindings of each existing layer followed by the bindings of each unique UV stream.
+		/// The index of a property is its position in this table.
+		/// </summary>
+		void BuildProperties() const
+		{
+			Properties.clear();
+
+			for (uint32_t i = 0; i < static_cast<uint32_t>(BSMaterialBinding::Bindings::Count); i++)
 			{
 				const BSMaterialBinding::Bindings binding = static_cast<BSMaterialBinding::Bindings>(i);
 				const char* pname = BSReflection::EnumToDisplayName(binding);
 
 				const uint16_t maxSupportedLayers = BSMaterialBinding::GetBindingSupportedLayerCount(binding);
-				if (maxSupportedLayers > 1)
+				for (uint16_t layerIndex = 0; layerIndex < maxSupportedLayers; layerIndex++)
 				{
-					for (uint16_t layerIndex = 0; layerIndex < maxSupportedLayers; layerIndex++)
+					if (GetLayer(LayeredMaterialID, layerIndex) != BSMaterial::NullIDC)
 					{
-						if (GetLayer(LayeredMaterialID, layerIndex) != BSMaterial::NullIDC)
+						SelectableProperty property;
+						property.Binding = binding;
+						property.LayerIndex = layerIndex;
+						if (maxSupportedLayers > 1)
+						{
+							property.DisplayName.SPrintF("%s [Layer %u]", pname, layerIndex + 1);
+						}
+						else
 						{
-							BSString name;
-							name.SPrintF("%s [Layer %u]", pname, layerIndex + 1);
-							result = aForEach(name.QString());
+							property.DisplayName = pname;
 						}
+						Properties.push_back(std::move(property));
 					}
 				}
-				else
-				{
-					result = aForEach(pname);
-				}
 			}
 
 			const BSScrapArray<BSMaterial::UVStreamID> uvStreams = CollectUVStreams(LayeredMaterialID);
@@ -702,49 +936,25 @@ namespace
 				BSFixedString streamName;
 				BSMaterial::GetName(BSMaterial::LayeredMaterialID{ streamID.QID() }, streamName);
 
-				for (uint32_t i = 0; i < static_cast<uint32_t>(BSMaterialBinding::UVStreamBindingType::Count) && result != BSContainer::Stop; i++)
+				for (uint32_t i = 0; i < static_cast<uint32_t>(BSMaterialBinding::UVStreamBindingType::Count); i++)
 				{
 					const BSMaterialBinding::UVStreamBindingType binding = static_cast<BSMaterialBinding::UVStreamBindingType>(i);
-					const char* pname = BSReflection::EnumToDisplayName(binding);
 
-					BSString propertyName;
-					propertyName.SPrintF("%s [%s]", pname, streamName.QString());
-					result = aForEach(propertyName.QString());
-				}
-			}
-
-			return result;
-		}
-
-		/// <summary>
-		/// Is our index value a valid binding?
-		/// </summary>
-		/// <param name="aIndex"> Our index value</param>
-		/// <returns> If our index is valid </returns>
-		bool IsIndexValid(uint32_t aIndex) const override
-		{
-			uint16_t layerCount = 0;
-			for(uint16_t i = 0; i < BSMaterial::MaxLayerCountC; i++)
-			{
-				if (GetLayer(LayeredMaterialID, i) != BSMaterial::NullIDC)
-				{
-					layerCount++;
+					SelectableProperty property;
+					property.UVStream = streamID;
+					property.UVBinding = binding;
+					property.DisplayName.SPrintF("%s [%s]", BSReflection::EnumToDisplayName(binding), streamName.QString());
+					Properties.push_back(std::move(property));
 				}
 			}
 
-			uint16_t totalCount = 0;
-			for (uint16_t i = 0; i < static_cast<uint32_t>(BSMaterialBinding::Bindings::Count); i++)
-			{
-				totalCount += std::min(BSMaterialBinding::GetBindingSupportedLayerCount(static_cast<BSMaterialBinding::Bindings>(i)), layerCount);
-			}
-
-			const BSScrapArray<BSMaterial::UVStreamID> uvStreams = CollectUVStreams(LayeredMaterialID);
-			totalCount += static_cast<uint16_t>(uvStreams.QSize() * ToUnderlyingType(BSMaterialBinding::UVStreamBindingType::Count));
-			return aIndex < totalCount;
+			PropertiesValid = true;
 		}
 
-	private:
 		const BSMaterial::LayeredMaterialID LayeredMaterialID;
+		mutable stl::vector<SelectableProperty> Properties;	// Selectable properties in index order.
+		mutable bool PropertiesValid = false;
+		uint32_t MaterialChangeListener = 0;				// Registration with the MaterialChangeNotifyService.
 
 	};
 
@@ -796,130 +1006,806 @@ namespace
 		BSMaterial::Internal::QDBStorage().VisitComponents(visitor, aObject, true);
 	}
 
-	/// <summary>
-	/// Get layer index for a given node.
-	/// </summary>
-	/// <param name="apModelNode">Model node index to search</param>
-	/// <returns>Index of the layer this node lives on, or InvalidLayerIdx if we are on the root or the node given is invalid.</returns>
-	uint16_t GetLayerIdxFromNode(const QtPropertyEditor::ModelNode& aModelNode)
+	/// <summary> Estimate the memory held by a Json value and its children. </summary>
+	/// <param name="aValue"> The Json value. </param>
+	/// <returns> Approximate size in bytes. </returns>
+	size_t EstimateJsonMemory(const Json::Value& aValue)
 	{
-		uint16_t idx = BSMaterialBinding::InvalidLayerIdxC;
-
-		//Find the first filter attribute above this node
-		const QtPropertyEditor::ModelNode* playerNode = aModelNode.QParent();
-
-		while (playerNode != nullptr && idx == BSMaterialBinding::InvalidLayerIdxC)
+		size_t size = sizeof(Json::Value);
+		if (aValue.isString())
 		{
-			if (playerNode->QMetadata().Has<BSReflection::Metadata::MaterialLayerIndex>())
+			size += aValue.asString().size();
+		}
+		else if (aValue.isArray() || aValue.isObject())
+		{
+			for (auto iter = aValue.begin(); iter != aValue.end(); ++iter)
 			{
-				idx = playerNode->QMetadata().Find<BSReflection::Metadata::MaterialLayerIndex>()->Index;
+				size += iter.name().size() + EstimateJsonMemory(*iter);
 			}
-
-			playerNode = playerNode->QParent();
 		}
-
-		return idx;
+		return size;
 	}
 
-	/// <summary>
-	/// Check if a node's path passes the filter for a given binding, empty filter counts as a pass.
-	/// </summary>
-	/// <param name="aBinding">Binding type to check filter for</param>
-	/// <param name="apModelNode">Model Node to check</param>
-	/// <returns>Pass or fail</returns>
-	bool DoesNodePassBindingViewFilter(BSMaterialBinding::Bindings aBinding, const QtPropertyEditor::ModelNode& aModelNode)
+	/// <summary> Undo data of the top layer of a material, added or removed on its own with the blender mixing it with the layers below. </summary>
+	struct LayerUndoDelta : public MaterialLayeringDialog::UndoPayload
 	{
-		using MaterialBindingFilter = BSReflection::Metadata::MaterialBindingFilter;
-
-		bool passes = true;
+		uint16_t LayerIndex = 0;
+		Json::Value Layer;
+		Json::Value Blender;		// Null for the first layer, which has no blender.
+		bool Present = true;		// If the layer is currently in the material.
+		size_t MemorySize = 0;		// Estimated once the layer is serialized.
 
-		//Find the first filter attribute above this node
-		const QtPropertyEditor::ModelNode* pfilterNode = aModelNode.QParent();
-		MaterialBindingFilter filter = MaterialBindingFilter::None;
+		size_t QMemorySize() const override { return MemorySize; }
+	};
 
-		while (pfilterNode != nullptr && filter == MaterialBindingFilter::None)
+	/// <summary> Find the top layer of a material. </summary>
+	/// <param name="aMaterial"> The layered material. </param>
+	/// <returns> Index of the top layer, MaxLayerCountC if the material has no layer. </returns>
+	uint16_t FindTopLayerIndex(BSMaterial::LayeredMaterialID aMaterial)
+	{
+		uint16_t layerIdx = BSMaterial::MaxLayerCountC;
+		for (uint16_t i = 0; i < BSMaterial::MaxLayerCountC; i++)
 		{
-			if (pfilterNode->QMetadata().Has<BSReflection::Metadata::MaterialBindingFilterAttribute>())
+			if (BSMaterial::GetLayer(aMaterial, i).QValid())
 			{
-				filter = pfilterNode->QMetadata().Find<BSReflection::Metadata::MaterialBindingFilterAttribute>()->Filter;
+				layerIdx = i;
 			}
-
-			pfilterNode = pfilterNode->QParent();
 		}
+		return layerIdx;
+	}
 
-		if (filter != MaterialBindingFilter::None)
+	/// <summary> Serialize the top layer of a material and its blender, without the rest of the material. </summary>
+	/// <param name="aMaterial"> The layered material. </param>
+	/// <returns> The undo data of the layer, nullptr if the material has no layer. </returns>
+	std::unique_ptr<LayerUndoDelta> CaptureTopLayer(BSMaterial::LayeredMaterialID aMaterial)
+	{
+		std::unique_ptr<LayerUndoDelta> spdelta;
+
+		const uint16_t layerIdx = FindTopLayerIndex(aMaterial);
+		if (layerIdx < BSMaterial::MaxLayerCountC)
 		{
-			switch (aBinding)
+			spdelta = stl::make_unique<LayerUndoDelta>();
+			LayerUndoDelta* pdelta = spdelta.get();
+			pdelta->LayerIndex = layerIdx;
+
+			// The layer above the first one is mixed by the blender of the slot below it.
+			const BSMaterial::LayerID layerID = BSMaterial::GetLayer(aMaterial, layerIdx);
+			const BSMaterial::BlenderID blenderID = layerIdx > 0 ? BSMaterial::GetBlender(aMaterial, static_cast<uint16_t>(layerIdx - 1)) : BSMaterial::BlenderID{};
+			BSMaterial::Internal::QDB2Instance().RequestExecuteForCreateAndDelete([pdelta, layerID, blenderID](BSComponentDB2::CreateAndDeleteInterface& arInterface)
 			{
-				//Intentional fallthrough
-			case BSMaterialBinding::Bindings::UVScale:
-			case BSMaterialBinding::Bindings::UVOffset:
-				if (filter != MaterialBindingFilter::UVStream)
-				{
-					passes = false;
-				}
-				break;
-				//Intentional fallthrough
-			case BSMaterialBinding::Bindings::BlenderUVScale:
-			case BSMaterialBinding::Bindings::BlenderUVOffset:
-				if (filter != MaterialBindingFilter::BlendMaskUVStream)
+				BSMaterial::Internal::QDBStorage().SaveJson(arInterface, layerID, pdelta->Layer);
+				if (blenderID.QValid())
 				{
-					passes = false;
+					BSMaterial::Internal::QDBStorage().SaveJson(arInterface, blenderID, pdelta->Blender);
 				}
-				break;
+			});
 
-				//Intentional fallthrough
-			case BSMaterialBinding::Bindings::OpacityBlenderUVScale:
-			case BSMaterialBinding::Bindings::OpacityBlenderUVOffset:
-				if (filter != MaterialBindingFilter::OpacityUVStream)
+			// We flush in order to execute the request above immediately, the layer is measured once serialized.
+			BSMaterial::Flush();
+			pdelta->MemorySize = sizeof(LayerUndoDelta) + EstimateJsonMemory(pdelta->Layer) + EstimateJsonMemory(pdelta->Blender);
+		}
+
+		return spdelta;
+	}
+
+	/// <summary> Load a serialized layer and its blender into the top layer of a material. </summary>
+	/// <param name="aMaterial"> The layered material. </param>
+	/// <param name="aLayerIdx"> Index of the top layer. </param>
+	/// <param name="aLayer"> Serialized layer. </param>
+	/// <param name="aBlender"> Serialized blender, null for the first layer. </param>
+	/// <returns> True once the layer is loaded, false if the top layer is not at aLayerIdx, its blender is missing or the load did not run. </returns>
+	bool LoadTopLayer(BSMaterial::LayeredMaterialID aMaterial, uint16_t aLayerIdx, const Json::Value& aLayer, const Json::Value& aBlender)
+	{
+		bool loaded = false;
+
+		if (aLayerIdx < BSMaterial::MaxLayerCountC && FindTopLayerIndex(aMaterial) == aLayerIdx)
+		{
+			// The layer above the first one is mixed by the blender of the slot below it.
+			const BSMaterial::LayerID layerID = BSMaterial::GetLayer(aMaterial, aLayerIdx);
+			const BSMaterial::BlenderID blenderID = aLayerIdx > 0 ? BSMaterial::GetBlender(aMaterial, static_cast<uint16_t>(aLayerIdx - 1)) : BSMaterial::BlenderID{};
+			if (layerID.QValid() && (aBlender.isNull() || blenderID.QValid()))
+			{
+				BSMaterial::Internal::QDB2Instance().RequestExecuteForCreateAndDelete([&aLayer, &aBlender, &loaded, layerID, blenderID](BSComponentDB2::CreateAndDeleteInterface& arInterface)
 				{
-					passes = false;
-				}
-				break;
-			default:
-				break;
+					BSMaterial::Internal::QDBStorage().LoadJson(arInterface, layerID, aLayer);
+					if (blenderID.QValid() && !aBlender.isNull())
+					{
+						BSMaterial::Internal::QDBStorage().LoadJson(arInterface, blenderID, aBlender);
+					}
+					loaded = true;
+				});
+
+				// We flush in order to execute the request above immediately, it reads the serialized layer through references.
+				BSMaterial::Flush();
 			}
 		}
 
-		return passes;
+		BSWARNING_IF(!loaded, WARN_MATERIALS, "Layer %u could not be restored on material %u, the material layout does not match the saved layer", aLayerIdx, aMaterial.QID().QValue());
+		return loaded;
 	}
-} // Anonymous
 
-namespace SharedTools
-{
-	// HWND of this dialog
-	HWND MaterialLayeringDialog::hwndDialog = 0;
+	/// <summary> Flags the materials saved within its scope, their change notifications are delivered before it ends. </summary>
+	class MaterialSaveScope
+	{
+	public:
+		explicit MaterialSaveScope(bool& arSaving) : rSaving(arSaving) { rSaving = true; }
+		~MaterialSaveScope()
+		{
+			BSMaterial::MaterialChangeNotifyService::QInstance().Flush();
+			rSaving = false;
+		}
+
+	private:
+		bool& rSaving;
+	};
 
 	/// <summary>
-	/// Material layering window Ctor
+	/// Split materials into save shards of about aShardSize materials. A material is kept in the shard of its data parents and
+	/// children, so a canceled or failed save never leaves a data parent saved without its children, or the other way around.
 	/// </summary>
-	/// <param name="parent"> Parent widget </param>
-	/// <param name="arSite"> Site to bind our service to </param>
-	MaterialLayeringDialog::MaterialLayeringDialog(QWidget *apParent, BSService::Site& arSite)
-		: QDialog(apParent)
-		, rSite(arSite)
-		, UseVersionControl(bUseVersionControl.Bool())
+	/// <param name="aMaterials"> The materials to save. </param>
+	/// <param name="aShardSize"> Materials per shard, exceeded by the shard of a family holding more materials. </param>
+	/// <returns> The shards, in the order of the first material of each family in aMaterials. </returns>
+	stl::vector<BSTArray<BSMaterial::LayeredMaterialID>> MakeSaveShards(const BSTArray<BSMaterial::LayeredMaterialID>& aMaterials, uint32_t aShardSize)
 	{
-		if (!QtPropertyEditor::TemplateManager::QInstance().QHasLoaded())
+		// Union find of the materials, each family is rooted at its first material.
+		const uint32_t materialCount = aMaterials.QSize();
+		stl::vector<uint32_t> families(materialCount);
+		stl::unordered_map<uint64_t, uint32_t> indices;
+		for (uint32_t i = 0; i < materialCount; i++)
 		{
-			QtPropertyEditor::TemplateManager::QInstance().LoadTemplates();
+			families[i] = i;
+			indices.emplace(aMaterials[i].QID().QValue(), i);
 		}
 
-		rSite.BindService(this);
-		ui.setupUi(this);
-		InitializeEditingComponents();
-		InitializePreviewWidget();
-		InitializeSignalsAndSlots();
-		UpdateButtonState();
-		CreationKit::Services::AssetHandlerService::QInstance().Register(this, BSMaterial::MatExt);
-		pUndoRedoStack = new QUndoStack(this);
-
-		PerforceSyncPath.Format("%s....mat", sLayeredMaterialDepotPath.String());
-	}
+		auto findFamily = [&families](uint32_t aIndex)
+		{
+			while (families[aIndex] != aIndex)
+			{
+				families[aIndex] = families[families[aIndex]];
+				aIndex = families[aIndex];
+			}
+			return aIndex;
+		};
 
-	MaterialLayeringDialog::~MaterialLayeringDialog()
-	{
+		for (uint32_t i = 0; i < materialCount; i++)
+		{
+			stl::scrap_set<BSMaterial::ID> dataParents;
+			BSMaterial::FindDataParents(aMaterials[i], dataParents);
+			for (BSMaterial::ID parent : dataParents)
+			{
+				auto iter = indices.find(BSMaterial::LayeredMaterialID(parent).QID().QValue());
+				if (iter != indices.end())
+				{
+					const uint32_t family = findFamily(i);
+					const uint32_t parentFamily = findFamily(iter->second);
+					families[std::max(family, parentFamily)] = std::min(family, parentFamily);
+				}
+			}
+		}
+
+		stl::vector<stl::vector<uint32_t>> members(materialCount);
+		for (uint32_t i = 0; i < materialCount; i++)
+		{
+			members[findFamily(i)].push_back(i);
+		}
+
+		// Fill the shards family by family.
+		stl::vector<BSTArray<BSMaterial::LayeredMaterialID>> shards;
+		for (const stl::vector<uint32_t>& rfamily : members)
+		{
+			if (!rfamily.empty())
+			{
+				if (shards.empty() || shards.back().QSize() + static_cast<uint32_t>(rfamily.size()) > aShardSize)
+				{
+					shards.emplace_back();
+				}
+				for (uint32_t index : rfamily)
+				{
+					shards.back().Add(aMaterials[index]);
+				}
+			}
+		}
+
+		return shards;
+	}
+
+	/// <summary> Context a property node inherits from its ancestors. </summary>
+	struct PropertyNodeContext
+	{
+		uint16_t LayerIdx = BSMaterialBinding::InvalidLayerIdxC;	// Nearest layer index above the node, invalid on the root.
+		BSReflection::Metadata::MaterialBindingFilter BindingFilter = BSReflection::Metadata::MaterialBindingFilter::None;	// Nearest binding filter above the node.
+		BSMaterial::LayerID Layer;									// Nearest layer above the node, invalid if the node is not in a layer.
+	};
+
+	/// <summary> Derive the context of a node's children from the node's own context and metadata. </summary>
+	/// <param name="aParentContext"> Context inherited by the parent node. </param>
+	/// <param name="arParentNode"> Parent node. </param>
+	/// <returns> The context inherited by the children of the parent node. </returns>
+	PropertyNodeContext InheritPropertyNodeContext(const PropertyNodeContext& aParentContext, QtPropertyEditor::ModelNode& arParentNode)
+	{
+		using MaterialBindingFilter = BSReflection::Metadata::MaterialBindingFilter;
+
+		PropertyNodeContext context = aParentContext;
+		const BSReflection::Attributes& rattribs = arParentNode.QMetadata();
+
+		if (rattribs.Has<BSReflection::Metadata::MaterialLayerIndex>())
+		{
+			const uint16_t idx = rattribs.Find<BSReflection::Metadata::MaterialLayerIndex>()->Index;
+			if (idx != BSMaterialBinding::InvalidLayerIdxC)
+			{
+				context.LayerIdx = idx;
+			}
+		}
+
+		if (rattribs.Has<BSReflection::Metadata::MaterialBindingFilterAttribute>())
+		{
+			const MaterialBindingFilter filter = rattribs.Find<BSReflection::Metadata::MaterialBindingFilterAttribute>()->Filter;
+			if (filter != MaterialBindingFilter::None)
+			{
+				context.BindingFilter = filter;
+			}
+		}
+
+		BSMaterial::LayerID layerID;
+		if (arParentNode.QModel() && arParentNode.GetNativeValue(BSReflection::Ptr(&layerID)))
+		{
+			context.Layer = layerID;
+		}
+
+		return context;
+	}
+
+	/// <summary>
+	/// Check if a node's path passes the filter for a given binding, empty filter counts as a pass.
+	/// </summary>
+	/// <param name="aBinding">Binding type to check filter for</param>
+	/// <param name="aFilter">Binding filter inherited by the node</param>
+	/// <returns>Pass or fail</returns>
+	bool DoesNodePassBindingViewFilter(BSMaterialBinding::Bindings aBinding, BSReflection::Metadata::MaterialBindingFilter aFilter)
+	{
+		using MaterialBindingFilter = BSReflection::Metadata::MaterialBindingFilter;
+
+		bool passes = true;
+		const MaterialBindingFilter filter = aFilter;
+
+		if (filter != MaterialBindingFilter::None)
+		{
+			switch (aBinding)
+			{
+				//Intentional fallthrough
+			case BSMaterialBinding::Bindings::UVScale:
+			case BSMaterialBinding::Bindings::UVOffset:
+				if (filter != MaterialBindingFilter::UVStream)
+				{
+					passes = false;
+				}
+				break;
+				//Intentional fallthrough
+			case BSMaterialBinding::Bindings::BlenderUVScale:
+			case BSMaterialBinding::Bindings::BlenderUVOffset:
+				if (filter != MaterialBindingFilter::BlendMaskUVStream)
+				{
+					passes = false;
+				}
+				break;
+
+				//Intentional fallthrough
+			case BSMaterialBinding::Bindings::OpacityBlenderUVScale:
+			case BSMaterialBinding::Bindings::OpacityBlenderUVOffset:
+				if (filter != MaterialBindingFilter::OpacityUVStream)
+				{
+					passes = false;
+				}
+				break;
+			default:
+				break;
+			}
+		}
+
+		return passes;
+	}
+
+	/// <summary> Check if a property node can be bound to a material or UV stream binding. </summary>
+	/// <param name="arNode"> Node to check. </param>
+	/// <returns> True if the node has binding metadata. </returns>
+	bool IsBindablePropertyNode(QtPropertyEditor::ModelNode& arNode)
+	{
+		const BSReflection::Attributes& rattribs = arNode.QMetadata();
+		return rattribs.Has<BSReflection::Metadata::MaterialBinding>() || rattribs.Has<BSReflection::Metadata::UVStreamBinding>();
+	}
+
+	/// <summary>
+	/// Single pass over the nodes of a built property tree. Each post build stage registers handlers for the kind of node it processes,
+	/// and the kind of each node (model node, LayerID value, persistent widgets) is resolved once instead of once per stage.
+	/// Handlers of a node run in this order: model node, layer node, widget, any node.
+	/// The pass only goes one level deep, collapsed subtrees are visited when they get expanded.
+	/// </summary>
+	class PropertyTreePass
+	{
+	public:
+		using NodeHandler = std::function<void(QtPropertyEditor::ModelNode&)>;
+		using LayerHandler = std::function<void(QtPropertyEditor::ModelNode&, BSMaterial::LayerID)>;
+		using WidgetHandler = std::function<void(QtPropertyEditor::ModelNode&, QtPropertyEditor::ModelNode::Column, QWidget*)>;
+
+		/// <summary> Register a handler for nodes with a model. </summary>
+		void OnModelNode(NodeHandler aHandler) { ModelNodeHandlers.emplace_back(std::move(aHandler)); }
+		/// <summary> Register a handler for nodes holding a LayerID. </summary>
+		void OnLayerNode(LayerHandler aHandler) { LayerNodeHandlers.emplace_back(std::move(aHandler)); }
+		/// <summary> Register a handler for each persistent widget of a node. </summary>
+		void OnWidget(WidgetHandler aHandler) { WidgetHandlers.emplace_back(std::move(aHandler)); }
+		/// <summary> Register a handler for every node. </summary>
+		void OnAnyNode(NodeHandler aHandler) { AnyNodeHandlers.emplace_back(std::move(aHandler)); }
+		/// <summary> Register a handler for every node, run before all the other handlers of the node. </summary>
+		void OnEnterNode(NodeHandler aHandler) { EnterNodeHandlers.emplace_back(std::move(aHandler)); }
+
+		/// <summary> Dispatch the direct children of a node to the registered handlers. </summary>
+		/// <param name="arParentNode"> Node whose children are visited. </param>
+		void VisitChildren(QtPropertyEditor::ModelNode& arParentNode) const
+		{
+			arParentNode.ForEach([this, &arParentNode](QtPropertyEditor::ModelNode& arChild)
+			{
+				if (&arChild != &arParentNode)
+				{
+					VisitNode(arChild);
+				}
+				return BSContainer::SkipChildren;
+			});
+		}
+
+		/// <summary> Dispatch a node to the registered handlers. </summary>
+		/// <param name="arNode"> Node to visit. </param>
+		void VisitNode(QtPropertyEditor::ModelNode& arNode) const
+		{
+			using namespace QtPropertyEditor;
+
+			for (const NodeHandler& rhandler : EnterNodeHandlers)
+			{
+				rhandler(arNode);
+			}
+
+			if (arNode.QModel())
+			{
+				for (const NodeHandler& rhandler : ModelNodeHandlers)
+				{
+					rhandler(arNode);
+				}
+
+				BSMaterial::LayerID layerID;
+				if (!LayerNodeHandlers.empty() && arNode.GetNativeValue(BSReflection::Ptr(&layerID)))
+				{
+					for (const LayerHandler& rhandler : LayerNodeHandlers)
+					{
+						rhandler(arNode, layerID);
+					}
+				}
+			}
+
+			if (!WidgetHandlers.empty())
+			{
+				for (auto columnId = ToUnderlyingType<ModelNode::Column>(ModelNode::Column::Name);
+					columnId < ToUnderlyingType<ModelNode::Column>(ModelNode::Column::Count); columnId++)
+				{
+					const ModelNode::Column column = FromUnderlyingType<ModelNode::Column>(columnId);
+					QWidget* pwidgetAtColumn = arNode.QPersistentWidget(column);
+					if (pwidgetAtColumn)
+					{
+						for (const WidgetHandler& rhandler : WidgetHandlers)
+						{
+							rhandler(arNode, column, pwidgetAtColumn);
+						}
+					}
+				}
+			}
+
+			for (const NodeHandler& rhandler : AnyNodeHandlers)
+			{
+				rhandler(arNode);
+			}
+		}
+
+	private:
+		stl::vector<NodeHandler> ModelNodeHandlers;
+		stl::vector<LayerHandler> LayerNodeHandlers;
+		stl::vector<WidgetHandler> WidgetHandlers;
+		stl::vector<NodeHandler> AnyNodeHandlers;
+		stl::vector<NodeHandler> EnterNodeHandlers;
+	};
+} // Anonymous
+
+namespace SharedTools
+{
+	// HWND of this dialog
+	HWND MaterialLayeringDialog::hwndDialog = 0;
+
+	/// <summary>
+	/// Inherited context of the processed property nodes, pushed down from parents to children. Keyed by data path rather than
+	/// by node, so a node the editor rebuilt by itself finds the context of the property it shows. Nodes without a data path
+	/// are not memoized.
+	/// </summary>
+	struct MaterialLayeringDialog::PropertyNodeContextTable
+	{
+		stl::unordered_map<BSFixedString, PropertyNodeContext> Contexts;
+
+		/// <summary> Record the context of a processed node. </summary>
+		/// <param name="arNode"> Property node. </param>
+		/// <param name="aContext"> The context inherited by the node. </param>
+		void Add(QtPropertyEditor::ModelNode& arNode, const PropertyNodeContext& aContext)
+		{
+			const BSFixedString dataPath(arNode.QDataPath().QString());
+			if (!dataPath.QEmpty())
+			{
+				Contexts.emplace(dataPath, aContext);
+			}
+		}
+
+		/// <summary> Find the context of a node, deriving it from its parent if the node was not processed yet. </summary>
+		/// <param name="arNode"> Property node. </param>
+		/// <returns> The context inherited by the node. </returns>
+		PropertyNodeContext Find(QtPropertyEditor::ModelNode& arNode)
+		{
+			PropertyNodeContext context;
+
+			const BSFixedString dataPath(arNode.QDataPath().QString());
+			auto iter = dataPath.QEmpty() ? Contexts.end() : Contexts.find(dataPath);
+			if (iter != Contexts.end())
+			{
+				context = iter->second;
+			}
+			else
+			{
+				QtPropertyEditor::ModelNode* pparent = arNode.QParent();
+				if (pparent != nullptr)
+				{
+					context = InheritPropertyNodeContext(Find(*pparent), *pparent);
+				}
+				Add(arNode, context);
+			}
+
+			return context;
+		}
+	};
+
+	/// <summary>
+	/// Append-only journal of the edits made to a material since it was last saved, replayed to recover them after a crash.
+	/// The file is memory mapped and written by a background job: journaling an edit only serializes it on the UI thread,
+	/// the job copies it into the mapping, growing the file when needed, and the system writes the pages back to disk.
+	/// The header holds the path of the material file, the records are only read back for the material they were written for.
+	/// </summary>
+	class MaterialLayeringDialog::EditJournal
+	{
+	public:
+		enum class RecordKind : uint32_t
+		{
+			PropertyChanged = 1,	// Value set to the property at DataPath.
+			LayerAdded,				// New default layer added on top of the layer stack.
+			LayerRemoved,			// Top layer removed.
+			LayerRestored,			// Layer added on top of the layer stack, Value holds the serialized layer and blender.
+		};
+
+		struct Record
+		{
+			RecordKind Kind = RecordKind::PropertyChanged;
+			QString DataPath;
+			QVariant Value;
+		};
+
+		/// <summary> Constructor </summary>
+		/// <param name="aFilePath"> Path of the journal file. </param>
+		/// <param name="aMaterialFile"> Path of the journaled material file. </param>
+		EditJournal(const QString& aFilePath, const QString& aMaterialFile) :
+			File(aFilePath),
+			MaterialFile(aMaterialFile.toLower().toUtf8()),
+			HeaderSize(2 * sizeof(uint32_t) + MaterialFile.size())
+		{
+		}
+
+		~EditJournal()
+		{
+			WaitForWrites();
+			Unmap();
+		}
+
+		/// <summary>
+		/// Open the journal file, creating it if needed. Records left by a previous session are kept if they were journaled for
+		/// the same material file, the journal starts over otherwise.
+		/// </summary>
+		/// <returns> True if the journal was opened and mapped. </returns>
+		bool Open()
+		{
+			if (File.open(QIODevice::ReadWrite) && Map(std::max({ File.size(), InitialCapacityC, HeaderSize + static_cast<qint64>(sizeof(uint32_t)) })))
+			{
+				if (QMatchesHeader())
+				{
+					// Records end at the first zero size, or at a record torn by a crash while it was appended.
+					WriteOffset = HeaderSize;
+					for (qint64 next = FindNextRecord(WriteOffset); next > 0; next = FindNextRecord(WriteOffset))
+					{
+						WriteOffset = next;
+					}
+				}
+				else
+				{
+					const uint32_t pathSize = static_cast<uint32_t>(MaterialFile.size());
+					memcpy(pData, &MagicC, sizeof(MagicC));
+					memcpy(pData + sizeof(MagicC), &pathSize, sizeof(pathSize));
+					memcpy(pData + 2 * sizeof(uint32_t), MaterialFile.constData(), pathSize);
+					ClearRecords();
+				}
+				Opened = true;
+				Empty = WriteOffset <= HeaderSize;
+			}
+
+			return Opened;
+		}
+
+		/// <returns> True if the journal holds no record, including the ones still being written. </returns>
+		bool QEmpty() const { return Empty; }
+
+		/// <summary> Read back the journaled records, oldest first. </summary>
+		stl::vector<Record> ReadRecords()
+		{
+			stl::vector<Record> records;
+
+			WaitForWrites();
+			for (qint64 offset = HeaderSize; offset < WriteOffset; offset = FindNextRecord(offset))
+			{
+				uint32_t size = 0;
+				uint32_t kind = 0;
+				memcpy(&size, pData + offset, sizeof(size));
+				memcpy(&kind, pData + offset + sizeof(size), sizeof(kind));
+
+				const QByteArray payload = QByteArray::fromRawData(reinterpret_cast<const char*>(pData + offset + RecordHeaderSizeC), static_cast<int32_t>(size));
+				QDataStream stream(payload);
+				Record record;
+				record.Kind = static_cast<RecordKind>(kind);
+				stream >> record.DataPath >> record.Value;
+				records.push_back(std::move(record));
+			}
+
+			return records;
+		}
+
+		/// <summary> Append a record. It is serialized right away and written to the file in the background. </summary>
+		/// <param name="aKind"> Kind of the journaled edit. </param>
+		/// <param name="aDataPath"> Data path of the changed property, if any. </param>
+		/// <param name="aValue"> Value of the edit, if any. </param>
+		void Append(RecordKind aKind, const QString& aDataPath = QString(), const QVariant& aValue = QVariant())
+		{
+			if (Opened)
+			{
+				QByteArray payload;
+				QDataStream stream(&payload, QIODevice::WriteOnly);
+				stream << aDataPath << aValue;
+
+				const uint32_t header[2] = { static_cast<uint32_t>(payload.size()), static_cast<uint32_t>(aKind) };
+				QByteArray record(reinterpret_cast<const char*>(header), sizeof(header));
+				record.append(payload);
+				Empty = false;
+				QueueWrite(std::move(record));
+			}
+		}
+
+		/// <summary> Drop all the records, once the edits they describe are saved or discarded. </summary>
+		void Clear()
+		{
+			if (Opened)
+			{
+				Empty = true;
+				QueueWrite(QByteArray());
+			}
+		}
+
+		/// <summary> Close and delete the journal file, once the pending records are written. </summary>
+		void Remove()
+		{
+			WaitForWrites();
+			Unmap();
+			Opened = false;
+			File.close();
+			File.remove();
+		}
+
+	private:
+		static constexpr uint32_t MagicC = 0x324a4c4d;							// 'MLJ2', followed by the size and path of the material file.
+		static constexpr qint64 RecordHeaderSizeC = 2 * sizeof(uint32_t);	// Payload size then record kind.
+		static constexpr qint64 InitialCapacityC = 64 * 1024;
+
+		/// <returns> True if the mapped header is the one of this journal, false for a new file or the journal of another material. </returns>
+		bool QMatchesHeader() const
+		{
+			uint32_t magic = 0;
+			uint32_t pathSize = 0;
+			memcpy(&magic, pData, sizeof(magic));
+			memcpy(&pathSize, pData + sizeof(magic), sizeof(pathSize));
+			return magic == MagicC && pathSize == static_cast<uint32_t>(MaterialFile.size()) && memcmp(pData + 2 * sizeof(uint32_t), MaterialFile.constData(), pathSize) == 0;
+		}
+
+		/// <summary> Queue a write for the background job, submitting the job if it is not already running. </summary>
+		/// <param name="aWrite"> Serialized record to append, empty to drop all the records. </param>
+		void QueueWrite(QByteArray&& aWrite)
+		{
+			QMutexLocker lock(&WriteLock);
+			if (aWrite.isEmpty())
+			{
+				// The records not written yet would be dropped anyway.
+				PendingWrites.clear();
+			}
+			PendingWrites.push_back(std::move(aWrite));
+			if (!WriterRunning)
+			{
+				WriterRunning = true;
+				BSJobs::GetBackgroundJobs2ThreadGroup()->Submit([this]() { WritePending(); });
+			}
+		}
+
+		/// <summary> Background job writing the queued records in order, until none is left. </summary>
+		void WritePending()
+		{
+			stl::vector<QByteArray> writes;
+
+			QMutexLocker lock(&WriteLock);
+			while (!PendingWrites.empty())
+			{
+				writes.swap(PendingWrites);
+				lock.unlock();
+				for (const QByteArray& rwrite : writes)
+				{
+					if (rwrite.isEmpty())
+					{
+						ClearRecords();
+					}
+					else
+					{
+						WriteRecord(rwrite);
+					}
+				}
+				writes.clear();
+				lock.relock();
+			}
+			WriterRunning = false;
+			WritesDone.wakeAll();
+		}
+
+		/// <summary> Wait for the background job to write the queued records. </summary>
+		void WaitForWrites()
+		{
+			QMutexLocker lock(&WriteLock);
+			while (WriterRunning)
+			{
+				WritesDone.wait(&WriteLock);
+			}
+		}
+
+		/// <summary> Copy a record into the mapping, growing the file when the mapping is full. </summary>
+		/// <param name="aRecord"> The record header followed by its payload. </param>
+		void WriteRecord(const QByteArray& aRecord)
+		{
+			// Keep a zero size after the last record to mark the end of the journal.
+			const qint64 recordSize = aRecord.size();
+			qint64 capacity = Capacity;
+			while (capacity > 0 && WriteOffset + recordSize + static_cast<qint64>(sizeof(uint32_t)) > capacity)
+			{
+				capacity *= 2;
+			}
+
+			if (pData != nullptr && (capacity == Capacity || Map(capacity)))
+			{
+				// The end mark is written first and the size last, a record is only read back once complete.
+				const uint32_t end = 0;
+				memcpy(pData + WriteOffset + recordSize, &end, sizeof(end));
+				memcpy(pData + WriteOffset + sizeof(uint32_t), aRecord.constData() + sizeof(uint32_t), static_cast<size_t>(recordSize - sizeof(uint32_t)));
+				memcpy(pData + WriteOffset, aRecord.constData(), sizeof(uint32_t));
+				WriteOffset += recordSize;
+			}
+		}
+
+		/// <summary> Drop all the records, ending the journal right after its header. </summary>
+		void ClearRecords()
+		{
+			if (pData != nullptr)
+			{
+				const uint32_t end = 0;
+				memcpy(pData + HeaderSize, &end, sizeof(end));
+				WriteOffset = HeaderSize;
+			}
+		}
+
+		/// <summary> Find the end of the record at an offset. </summary>
+		/// <param name="aOffset"> Offset of the record. </param>
+		/// <returns> Offset following the record, 0 if there is no complete record at aOffset. </returns>
+		qint64 FindNextRecord(qint64 aOffset) const
+		{
+			qint64 next = 0;
+
+			uint32_t size = 0;
+			if (aOffset + RecordHeaderSizeC <= Capacity)
+			{
+				memcpy(&size, pData + aOffset, sizeof(size));
+			}
+			if (size > 0 && aOffset + RecordHeaderSizeC + size <= Capacity)
+			{
+				next = aOffset + RecordHeaderSizeC + size;
+			}
+
+			return next;
+		}
+
+		/// <summary> Map the file, growing it to a capacity. The grown part of the file is zero filled. </summary>
+		/// <param name="aCapacity"> Size of the mapping. </param>
+		/// <returns> True if the file was mapped. </returns>
+		bool Map(qint64 aCapacity)
+		{
+			Unmap();
+			if (File.size() >= aCapacity || File.resize(aCapacity))
+			{
+				pData = File.map(0, aCapacity);
+			}
+			Capacity = pData != nullptr ? aCapacity : 0;
+			return pData != nullptr;
+		}
+
+		void Unmap()
+		{
+			if (pData != nullptr)
+			{
+				File.unmap(pData);
+				pData = nullptr;
+			}
+		}
+
+		QFile File;
+		const QByteArray MaterialFile;		// Lower case path of the journaled material file, stored in the header.
+		const qint64 HeaderSize;			// Magic, then size and path of the material file.
+		bool Opened = false;				// Set by Open, the UI thread queues writes only once opened.
+		bool Empty = true;					// If no record is journaled, as seen from the UI thread.
+
+		// Written by the background job once the journal is opened.
+		uchar* pData = nullptr;
+		qint64 Capacity = 0;				// Size of the mapping.
+		qint64 WriteOffset = 0;				// Offset the next record is written at.
+
+		QMutex WriteLock;					// Guards PendingWrites and WriterRunning.
+		QWaitCondition WritesDone;			// Signaled when the background job has no write left.
+		stl::vector<QByteArray> PendingWrites;	// Records to append, an empty one drops all the records.
+		bool WriterRunning = false;
+	};
+
+	/// <summary>
+	/// Material layering window Ctor
+	/// </summary>
+	/// <param name="parent"> Parent widget </param>
+	/// <param name="arSite"> Site to bind our service to </param>
+	MaterialLayeringDialog::MaterialLayeringDialog(QWidget *apParent, BSService::Site& arSite)
+		: QDialog(apParent)
+		, rSite(arSite)
+		, spNodeContexts(std::make_unique<PropertyNodeContextTable>())
+		, UseVersionControl(bUseVersionControl.Bool())
+	{
+		if (!QtPropertyEditor::TemplateManager::QInstance().QHasLoaded())
+		{
+			QtPropertyEditor::TemplateManager::QInstance().LoadTemplates();
+		}
+
+		rSite.BindService(this);
+		// Every change of the material DB outdates the stashed editing sessions depending on it, not only the edits made here.
+		MaterialChangeListener = BSMaterial::MaterialChangeNotifyService::QInstance().AddListener([this](BSComponentDB2::ID aObject) { OnMaterialObjectChanged(aObject); });
+		ui.setupUi(this);
+		InitializeEditingComponents();
+		InitializePreviewWidget();
+		InitializeSignalsAndSlots();
+		UpdateButtonState();
+		CreationKit::Services::AssetHandlerService::QInstance().Register(this, BSMaterial::MatExt);
+		pUndoRedoStack = new QUndoStack(this);
+		connect(pUndoRedoStack, &QUndoStack::indexChanged, this, [this]() { MarkMaterialEdited(EditedMaterialID); });
+
+		PerforceSyncPath.Format("%s....mat", sLayeredMaterialDepotPath.String());
+	}
+
+	MaterialLayeringDialog::~MaterialLayeringDialog()
+	{
 		CreationKit::Services::AssetHandlerService::QInstance().Unregister(this);
+		BSMaterial::MaterialChangeNotifyService::QInstance().RemoveListener(MaterialChangeListener);
 		Close();
 		rSite.UnbindService(this);
 	}
@@ -996,75 +1882,411 @@ namespace SharedTools
 			pFormPreviewDialog->hide();
 		}
 
-		if (!Application.bPreviewOnly)
+		if (!Application.bPreviewOnly)
+		{
+			apEvent->ignore();
+		}
+	}
+
+	///<summary> SLOT OVERRIDE: Handles dialog rejection signal. </summary>
+	void MaterialLayeringDialog::reject()
+	{
+		if (isVisible())
+		{
+			SaveWindowState();
+			pFormPreviewDialog->hide();
+		}
+
+		QDialog::reject();
+	}
+
+	///<summary> Determines whether the specified file is supported by the Material Layering Dialog. </summary>
+	///<param name="apFilepath"> The file to test. </param>
+	///<returns> True if the file can be loaded by the Material Layering Dialog. </returns>
+	bool MaterialLayeringDialog::GetIsFileSupported(const char* apFilepath)
+	{
+		const BSResource::ID file(apFilepath);
+		return (file.QExt() == BSMaterial::MatExt.QExt());
+	}
+
+	/// <summary> Open a layered material for editing </summary>
+	/// <param name="aMaterial"> material to edit </param>
+	/// <returns> true if the material can now be edited </returns>
+	bool MaterialLayeringDialog::Open(BSMaterial::LayeredMaterialID aMaterial)
+	{
+		bool result = false;
+
+		OpenedSMStateValid = false;
+		SwitchEditingSession(aMaterial);
+
+		EditedMaterialID = aMaterial;
+		EditedSubMaterial = aMaterial;
+
+		// Inform the Material browser which material is open
+
+		if (EditedMaterialID.QValid())
+		{
+			SharedTools::CursorScope cursor(Qt::WaitCursor);
+
+			UpdateLODCombo();
+
+			ui.pMaterialBrowserWidget->SelectMaterial(EditedMaterialID);
+			AdjustSceneForDecalPreview();
+
+			AttachOpenedMaterial();
+
+			result = true;
+		}
+		else
+		{
+			Close();
+			BSWARNING(WARN_MATERIALS, "MaterialLayeringDialog::Open: The specified layered material is invalid.");
+		}
+
+		return result;
+	}
+
+	/// <summary> Build the property editor of the opened material with all its properties collapsed. </summary>
+	void MaterialLayeringDialog::AttachOpenedMaterial()
+	{
+		// For perf reasons we make sure the Property Editor does not refresh while its populating/expanding
+		ui.treeViewPropEditor->setUpdatesEnabled(false);
+
+		BuildPropertyEditor();
+
+		// Collapsed subtrees are only processed once expanded.
+		using namespace QtPropertyEditor;
+		ui.treeViewPropEditor->ProcessDefaultState(QtGenericPropertyEditor::ItemState::Collapsed);
+
+		// Restore the view of a resumed editing session.
+		if (!PendingExpandedProperties.empty())
+		{
+			QSet<QString> paths;
+			for (const QString& rpath : PendingExpandedProperties)
+			{
+				paths.insert(rpath);
+			}
+			ExpandProperties(QModelIndex(), QString(), paths);
+			PendingExpandedProperties.clear();
+		}
+		ui.treeViewPropEditor->setUpdatesEnabled(true);
+
+		if (PendingScrollPosition != 0)
+		{
+			ui.treeViewPropEditor->verticalScrollBar()->setValue(PendingScrollPosition);
+			PendingScrollPosition = 0;
+		}
+
+		OpenEditJournal();
+	}
+
+	/// <summary>
+	/// Stash the editing session of the edited material and resume the session of the material about to be opened if it was
+	/// recently edited: its undo history, expanded properties, scroll position and Shader Model state if still valid.
+	/// </summary>
+	/// <param name="aNextMaterial"> The material about to be opened. </param>
+	void MaterialLayeringDialog::SwitchEditingSession(BSMaterial::LayeredMaterialID aNextMaterial)
+	{
+		// Notify the last property changes of the material being left.
+		if (PropertyChangePending)
+		{
+			PropertyChangePending = false;
+			OnMaterialPropertyChanged();
+		}
+		PropertyChangeTimer.stop();
+
+		PendingExpandedProperties.clear();
+		PendingScrollPosition = 0;
+
+		if (EditedMaterialID.QValid() && EditedMaterialID != aNextMaterial)
+		{
+			if (RecentMaterials.size() == RecentMaterialCountC)
+			{
+				delete RecentMaterials.front().pUndoStack;
+				RecentMaterials.erase(RecentMaterials.begin());
+			}
+
+			RecentMaterial session;
+			session.Material = EditedMaterialID;
+			session.pUndoStack = pUndoRedoStack;
+			session.State = MaterialSMState;
+			session.StateValid = EditedSubMaterial == EditedMaterialID;
+			session.ShaderModelRevision = SharedTools::QShaderModelTemplateRevision();
+			session.EditSerial = EditSerial;
+			session.ScrollPosition = ui.treeViewPropEditor->verticalScrollBar()->value();
+			CollectExpandedProperties(QModelIndex(), QString(), session.ExpandedProperties);
+
+			stl::scrap_set<BSMaterial::ID> dataParents;
+			BSMaterial::FindDataParents(EditedMaterialID, dataParents);
+			session.DataParents.assign(dataParents.begin(), dataParents.end());
+
+			RecentMaterials.push_back(std::move(session));
+			pUndoRedoStack = nullptr;
+		}
+
+		auto iter = std::find_if(RecentMaterials.begin(), RecentMaterials.end(), [aNextMaterial](const RecentMaterial& arSession) { return arSession.Material == aNextMaterial; });
+		if (aNextMaterial.QValid() && iter != RecentMaterials.end())
+		{
+			delete pUndoRedoStack;
+			pUndoRedoStack = iter->pUndoStack;
+			if (IsSessionStateValid(*iter))
+			{
+				OpenedSMState = iter->State;
+				OpenedSMStateValid = true;
+			}
+			PendingExpandedProperties = std::move(iter->ExpandedProperties);
+			PendingScrollPosition = iter->ScrollPosition;
+			RecentMaterials.erase(iter);
+		}
+		else if (pUndoRedoStack == nullptr)
+		{
+			pUndoRedoStack = new QUndoStack(this);
+			connect(pUndoRedoStack, &QUndoStack::indexChanged, this, [this]() { MarkMaterialEdited(EditedMaterialID); });
+		}
+		else
+		{
+			pUndoRedoStack->clear();
+		}
+	}
+
+	/// <summary> Test if the Shader Model state of a stashed session is still valid. </summary>
+	/// <param name="aSession"> The stashed editing session. </param>
+	/// <returns> True if neither the material, its data parents nor the Shader Model templates changed since it was stashed. </returns>
+	bool MaterialLayeringDialog::IsSessionStateValid(const RecentMaterial& aSession) const
+	{
+		auto isEditedSince = [this, &aSession](BSMaterial::LayeredMaterialID aMaterial)
+		{
+			auto iter = MaterialEditSerials.find(aMaterial.QID().QValue());
+			return iter != MaterialEditSerials.end() && iter->second > aSession.EditSerial;
+		};
+
+		bool valid = aSession.StateValid && aSession.ShaderModelRevision == SharedTools::QShaderModelTemplateRevision() && !isEditedSince(aSession.Material);
+		for (uint32_t i = 0; i < aSession.DataParents.size() && valid; i++)
 		{
-			apEvent->ignore();
+			valid = !isEditedSince(BSMaterial::LayeredMaterialID(aSession.DataParents[i]));
 		}
+		return valid;
 	}
 
-	///<summary> SLOT OVERRIDE: Handles dialog rejection signal. </summary>
-	void MaterialLayeringDialog::reject()
+	/// <summary> Record an edit of a material, outdating the stashed states depending on it. </summary>
+	/// <param name="aMaterial"> The edited material. </param>
+	void MaterialLayeringDialog::MarkMaterialEdited(BSMaterial::LayeredMaterialID aMaterial)
 	{
-		if (isVisible())
+		if (aMaterial.QValid())
 		{
-			SaveWindowState();
-			pFormPreviewDialog->hide();
+			MaterialEditSerials[aMaterial.QID().QValue()] = ++EditSerial;
 		}
-
-		QDialog::reject();
 	}
 
-	///<summary> Determines whether the specified file is supported by the Material Layering Dialog. </summary>
-	///<param name="apFilepath"> The file to test. </param>
-	///<returns> True if the file can be loaded by the Material Layering Dialog. </returns>
-	bool MaterialLayeringDialog::GetIsFileSupported(const char* apFilepath)
+	/// <summary>
+	/// Called for each material DB object notified as changed: a migration, revert, reload, reparent or save as well as an edit.
+	/// Outdates the stashed states depending on the owning material. The stashed undo history of that material is dropped
+	/// unless the dialog is saving it, since it no longer applies once the material was changed or reverted elsewhere.
+	/// The properties a changed Shader Model root material leaves to its Shader Model are recomputed on the next migration.
+	/// </summary>
+	/// <param name="aObject"> The changed object, a layered material or one of its layers, blenders or other sub objects. </param>
+	void MaterialLayeringDialog::OnMaterialObjectChanged(BSComponentDB2::ID aObject)
 	{
-		const BSResource::ID file(apFilepath);
-		return (file.QExt() == BSMaterial::MatExt.QExt());
+		const BSMaterial::LayeredMaterialID material = FindOwningLayeredMaterial(aObject);
+		if (material.QValid())
+		{
+			// Sessions of the data children are outdated through their data parents.
+			MarkMaterialEdited(material);
+
+			if (BSMaterial::IsShaderModelRootMaterial(material))
+			{
+				SharedTools::InvalidateShaderModelPropertyMask(material);
+			}
+
+			auto iter = std::find_if(RecentMaterials.begin(), RecentMaterials.end(), [material](const RecentMaterial& arSession) { return arSession.Material == material; });
+			if (iter != RecentMaterials.end() && !SavingMaterials)
+			{
+				delete iter->pUndoStack;
+				RecentMaterials.erase(iter);
+			}
+		}
 	}
 
-	/// <summary> Open a layered material for editing </summary>
-	/// <param name="aMaterial"> material to edit </param>
-	/// <returns> true if the material can now be edited </returns>
-	bool MaterialLayeringDialog::Open(BSMaterial::LayeredMaterialID aMaterial)
+	/// <summary>
+	/// Open the edit journal of the edited material, offering to recover the edits it holds if a previous session ended
+	/// without saving or discarding them. Only materials with a file on disk are journaled.
+	/// </summary>
+	void MaterialLayeringDialog::OpenEditJournal()
 	{
-		bool result = false;
+		CloseEditJournal();
 
-		pUndoRedoStack->clear();
+		BSFilePathString filename;
+		if (EditedFileExists() && BSMaterial::Internal::QDBStorage().GetObjectFilename(EditedMaterialID, filename))
+		{
+			const QDir journalDir(QStandardPaths::writableLocation(QStandardPaths::AppLocalDataLocation) + "/MaterialEditJournals");
+			journalDir.mkpath(".");
+			const QString materialFile(filename.QString());
+			const QString journalName = QString::fromLatin1(QCryptographicHash::hash(materialFile.toLower().toUtf8(), QCryptographicHash::Sha1).toHex()) + ".mlj";
+
+			spEditJournal = stl::make_unique<EditJournal>(journalDir.filePath(journalName), materialFile);
+			JournaledMaterial = EditedMaterialID;
+			if (!spEditJournal->Open())
+			{
+				BSWARNING(WARN_MATERIALS, "MaterialLayeringDialog::OpenEditJournal: Could not open the edit journal of %s, its edits cannot be recovered.", filename.QString());
+				spEditJournal.reset();
+				JournaledMaterial = BSMaterial::LayeredMaterialID{};
+			}
+			else if (!spEditJournal->QEmpty() && !EditedMaterialIsModified)
+			{
+				// The material is as saved, the journaled edits were left by a session that did not close properly.
+				const QString question = QString::asprintf("%s has unsaved changes from a session that did not close properly. Recover them?", filename.QString());
+				if (QMessageBox::question(this, pDialogTitleC, question, QMessageBox::Yes | QMessageBox::No) == QMessageBox::Yes)
+				{
+					ReplayEditJournal();
+				}
+				else
+				{
+					spEditJournal->Clear();
+				}
+			}
+		}
+	}
 
-		EditedMaterialID = aMaterial;
-		EditedSubMaterial = aMaterial;
+	/// <summary> Close the edit journal, deleting its file unless it holds the unsaved edits of a material still modified. </summary>
+	void MaterialLayeringDialog::CloseEditJournal()
+	{
+		if (spEditJournal)
+		{
+			if (spEditJournal->QEmpty() || !BSMaterial::Internal::QDBStorage().IsFileModified(JournaledMaterial))
+			{
+				spEditJournal->Remove();
+			}
+			spEditJournal.reset();
+			JournaledMaterial = BSMaterial::LayeredMaterialID{};
+		}
+	}
 
-		// Inform the Material browser which material is open
+	/// <summary> Apply the edits recorded in the edit journal to the edited material, in the order they were made. </summary>
+	void MaterialLayeringDialog::ReplayEditJournal()
+	{
+		using namespace QtPropertyEditor;
+		CursorScope cursor(Qt::WaitCursor);
+		ReplayingJournal = true;
 
-		if (EditedMaterialID.QValid())
+		// Property nodes by data path, collected again once a layer edit reshaped the tree.
+		QHash<QString, ModelNode*> nodes;
+		bool nodesValid = false;
+		uint32_t skippedCount = 0;
+		for (const EditJournal::Record& rrecord : spEditJournal->ReadRecords())
 		{
-			SharedTools::CursorScope cursor(Qt::WaitCursor);
+			switch (rrecord.Kind)
+			{
+			case EditJournal::RecordKind::PropertyChanged:
+				if (!nodesValid && ui.treeViewPropEditor->QTreeNode() != nullptr)
+				{
+					nodes.clear();
+					ui.treeViewPropEditor->QTreeNode()->ApplyRecursively([&nodes](ModelNode& arNode) { nodes.insert(QString(arNode.QDataPath().QString()), &arNode); });
+					nodesValid = true;
+				}
+				if (ModelNode* pnode = nodes.value(rrecord.DataPath, nullptr))
+				{
+					UndoCommand command(pnode->QModel(), pnode->QDataPath(), QVariant(), rrecord.Value, ui.treeViewPropEditor);
+					command.redo();
+				}
+				else
+				{
+					skippedCount++;
+				}
+				break;
 
-			UpdateLODCombo();
-			
-			// For perf reasons we make sure the Property Editor does not refresh while its populating/expanding
-			ui.treeViewPropEditor->setUpdatesEnabled(false);
+			case EditJournal::RecordKind::LayerAdded:
+			case EditJournal::RecordKind::LayerRestored:
+				if (BSMaterial::AddNewLayer(EditedMaterialID))
+				{
+					BSMaterial::Flush();
+					const QStringList serialized = rrecord.Value.toStringList();
+					if (rrecord.Kind == EditJournal::RecordKind::LayerRestored && serialized.size() == 2)
+					{
+						Json::Value layer;
+						Json::Value blender;
+						Json::Reader reader;
+						reader.parse(serialized[0].toStdString(), layer);
+						reader.parse(serialized[1].toStdString(), blender);
+						if (!LoadTopLayer(EditedMaterialID, FindTopLayerIndex(EditedMaterialID), layer, blender))
+						{
+							// Leave the material as it was rather than keep a default layer in place of the restored one.
+							BSMaterial::RemoveLastLayer(EditedMaterialID);
+							BSMaterial::Flush();
+						}
+					}
+					BuildPropertyEditor();
+					nodesValid = false;
+				}
+				break;
 
-			ui.pMaterialBrowserWidget->SelectMaterial(EditedMaterialID);
-			AdjustSceneForDecalPreview();
+			case EditJournal::RecordKind::LayerRemoved:
+				if (BSMaterial::RemoveLastLayer(EditedMaterialID))
+				{
+					BSMaterial::Flush();
+					BuildPropertyEditor();
+					nodesValid = false;
+				}
+				break;
+			}
+		}
 
-			BuildPropertyEditor();
+		BSWARNING_IF(skippedCount > 0, WARN_MATERIALS, "MaterialLayeringDialog::ReplayEditJournal: %u journaled property changes no longer match a property and were skipped.", skippedCount);
 
-			// When opening a new material file, expand all properties the first time.
-			using namespace QtPropertyEditor;
-			ui.treeViewPropEditor->ProcessDefaultState(QtGenericPropertyEditor::ItemState::Collapsed);
-			ui.treeViewPropEditor->setUpdatesEnabled(true);
+		ReplayingJournal = false;
+		OnMaterialPropertyChanged();
+		RequestPropertyEditorRefresh(PropertyEditorRefresh::Rebuild, "Journaled edits recovered");
+	}
 
-			result = true;
+	/// <summary> Journal the value set to a property of the edited material, LOD materials are not journaled. </summary>
+	/// <param name="aDataPath"> Data path of the changed property. </param>
+	/// <param name="aValue"> The value set to the property. </param>
+	void MaterialLayeringDialog::JournalPropertyEdit(const QString& aDataPath, const QVariant& aValue)
+	{
+		if (spEditJournal && !ReplayingJournal && EditedSubMaterial == JournaledMaterial)
+		{
+			spEditJournal->Append(EditJournal::RecordKind::PropertyChanged, aDataPath, aValue);
 		}
-		else
+	}
+
+	/// <summary> Collect the expanded properties of the property editor, identified by their display name path. </summary>
+	/// <param name="aParent"> Index whose children are collected. </param>
+	/// <param name="aParentPath"> Display name path of aParent. </param>
+	/// <param name="arPaths"> OUT: Receives the path of each expanded property. </param>
+	void MaterialLayeringDialog::CollectExpandedProperties(const QModelIndex& aParent, const QString& aParentPath, stl::vector<QString>& arPaths)
+	{
+		const QAbstractItemModel* pmodel = ui.treeViewPropEditor->model();
+		const int32_t rowCount = pmodel->rowCount(aParent);
+		for (int32_t row = 0; row < rowCount; row++)
 		{
-			Close();
-			BSWARNING(WARN_MATERIALS, "MaterialLayeringDialog::Open: The specified layered material is invalid.");
+			const QModelIndex index = pmodel->index(row, 0, aParent);
+			if (ui.treeViewPropEditor->isExpanded(index))
+			{
+				const QString path = aParentPath + '/' + index.data(Qt::DisplayRole).toString();
+				arPaths.push_back(path);
+				CollectExpandedProperties(index, path, arPaths);
+			}
 		}
+	}
 
-		return result;
+	/// <summary> Expand the properties of the property editor found in a set of display name paths. </summary>
+	/// <param name="aParent"> Index whose children are expanded. </param>
+	/// <param name="aParentPath"> Display name path of aParent. </param>
+	/// <param name="aPaths"> Paths of the properties to expand. </param>
+	void MaterialLayeringDialog::ExpandProperties(const QModelIndex& aParent, const QString& aParentPath, const QSet<QString>& aPaths)
+	{
+		const QAbstractItemModel* pmodel = ui.treeViewPropEditor->model();
+		const int32_t rowCount = pmodel->rowCount(aParent);
+		for (int32_t row = 0; row < rowCount; row++)
+		{
+			const QModelIndex index = pmodel->index(row, 0, aParent);
+			const QString path = aParentPath + '/' + index.data(Qt::DisplayRole).toString();
+			if (aPaths.contains(path))
+			{
+				// Expanding processes the deferred children of the property.
+				ui.treeViewPropEditor->expand(index);
+				ExpandProperties(index, path, aPaths);
+			}
+		}
 	}
 
 	/// <summary>
@@ -1107,9 +2329,14 @@ namespace SharedTools
 	/// <summary> Initialize the contents of the PropertyEditor </summary>
 	void MaterialLayeringDialog::BuildPropertyEditor()
 	{
+		// A pending property editor request is satisfied by this build.
+		PendingRefreshes.PropertyEditor = false;
+		PendingRefreshes.PropertyEditorMode = PropertyEditorRefresh::Incremental;
+
 		// Clear assigned shared ptr processors.
 		ui.treeViewPropEditor->QProcessors().clear();
 		ui.treeViewPropEditor->QPostProcessors().clear();
+		AppliedShaderModel = BSFixedString();
 
 		// Ensure all changes have been committed to the DB
 		BSMaterial::Flush();
@@ -1125,49 +2352,113 @@ namespace SharedTools
 			ApplyShaderModel(shaderModel.QString());
 		}
 
+		// Registered with the editor so they also run when it re-processes nodes by itself, such as on a forced refresh.
+		BoundProperties.Clear();
+		spNodeContexts->Contexts.clear();
 		ui.treeViewPropEditor->QPostProcessors().emplace_back(
-			std::shared_ptr<QtPropertyEditor::CustomUIProcessor>(
-				new QtPropertyEditor::CustomUIProcessor(BSMaterial::LayerID::ReflectedType, std::bind(&MaterialLayeringDialog::UICustomProcessLayerNode, this, std::placeholders::_1))));
-
+			std::make_shared<QtPropertyEditor::CustomUIProcessor>(BSMaterial::LayerID::ReflectedType, [this](QtPropertyEditor::ModelNode& arNode)
+			{
+				BSMaterial::LayerID layerID;
+				if (arNode.QModel() && arNode.GetNativeValue(BSReflection::Ptr(&layerID)))
+				{
+					UICustomProcessLayerNode(arNode, layerID);
+				}
+			}));
 		ui.treeViewPropEditor->QPostProcessors().emplace_back(
-			std::shared_ptr<QtPropertyEditor::CustomUIProcessor>(
-				new QtPropertyEditor::CustomUIProcessor([this](QtPropertyEditor::ModelNode& arNode) { BuildIconsForBoundProperties( ui.treeViewPropEditor, arNode); })));
+			std::make_shared<QtPropertyEditor::CustomUIProcessor>([this](QtPropertyEditor::ModelNode& arNode)
+			{
+				if (arNode.QModel())
+				{
+					BuildIconsForBoundProperties(ui.treeViewPropEditor, arNode);
+				}
+			}));
 
 		// Create model for the property editor.
 		BSReflection::AttributeMap attributes(BSReflection::Metadata::DBObjectDocument{ EditedMaterialID.QID().QValue() });
 		ui.treeViewPropEditor->BeginAddObjects();
 		ui.treeViewPropEditor->AddEditedObject(BSReflection::ObjectPtr(&EditedSubMaterial), nullptr, &attributes);
-		ui.treeViewPropEditor->EndAddObjects(UIProcessorsActive);
+		ui.treeViewPropEditor->EndAddObjects(true);
 
 		UpdateLODCombo();
 		UpdateDocumentModified();
-		UpdatePreview();
+		RequestPreviewUpdate("Property editor built");
 		UpdateMaterialShaderModelState();
-		PropagateShaderModelState();
+		ProcessPropertyTree();
 		UpdateButtonState();
+
+		BuiltTreeSignature = CalculatePropertyTreeSignature();
+	}
+
+	/// <summary> Collect the objects shaping the property tree of the edited material. </summary>
+	/// <returns> The signature of the property tree built for the edited material. </returns>
+	MaterialLayeringDialog::PropertyTreeSignature MaterialLayeringDialog::CalculatePropertyTreeSignature() const
+	{
+		PropertyTreeSignature signature;
+		signature.Material = EditedSubMaterial;
+		signature.State = MaterialSMState;
+
+		if (EditedSubMaterial.QValid())
+		{
+			if (!BSMaterial::IsShaderModelRootMaterial(EditedSubMaterial))
+			{
+				signature.ShaderModel = GetShaderModelName(EditedSubMaterial);
+			}
+			signature.ShaderModelRevision = SharedTools::QShaderModelTemplateRevision();
+
+			for (uint8_t layerIdx = 0; layerIdx < BSMaterial::MaxLayerCountC; ++layerIdx)
+			{
+				const BSMaterial::LayerID layerID = BSMaterial::GetLayer(EditedSubMaterial, layerIdx);
+				signature.Layers.push_back(layerID);
+				signature.UVStreams.push_back(layerID.QValid() ? BSMaterial::GetUVStream(layerID) : BSMaterial::UVStreamID{});
+			}
+
+			for (uint8_t blenderIdx = 0; blenderIdx < BSMaterial::MaxBlenderCountC; ++blenderIdx)
+			{
+				const BSMaterial::BlenderID blenderID = BSMaterial::GetBlender(EditedSubMaterial, blenderIdx);
+				signature.Blenders.push_back(blenderID);
+				signature.UVStreams.push_back(blenderID.QValid() ? BSMaterial::GetUVStream(blenderID) : BSMaterial::UVStreamID{});
+			}
+
+			signature.UVStreams.push_back(BSMaterial::GetLayeredMaterialAlphaSettings(EditedSubMaterial).Blender.OpacityUVStream);
+		}
+
+		return signature;
+	}
+
+	/// <summary> Compare the objects shaping two property trees. </summary>
+	/// <param name="aOther"> Signature to compare with. </param>
+	/// <returns> True if both signatures build the same property tree. </returns>
+	bool MaterialLayeringDialog::PropertyTreeSignature::operator==(const PropertyTreeSignature& aOther) const
+	{
+		return Material == aOther.Material &&
+			ShaderModel == aOther.ShaderModel &&
+			ShaderModelRevision == aOther.ShaderModelRevision &&
+			State.LayersInUse == aOther.State.LayersInUse &&
+			State.LayerCount == aOther.State.LayerCount &&
+			State.BlenderCount == aOther.State.BlenderCount &&
+			Layers == aOther.Layers &&
+			Blenders == aOther.Blenders &&
+			UVStreams == aOther.UVStreams;
 	}
 
 	/// <summary>
-	/// Callback for the CustomUIProcessor added to the property editor. This specifically handles the UI processing for Layer nodes.
+	/// Post processor handler for Layer nodes. This specifically handles the UI processing for Layer nodes.
 	/// </summary>
 	/// <param name="arNode">The PropertyEditor node for LayerID objects.</param>
-	void MaterialLayeringDialog::UICustomProcessLayerNode(QtPropertyEditor::ModelNode& arNode)
+	/// <param name="aLayerID">The layer held by the node.</param>
+	void MaterialLayeringDialog::UICustomProcessLayerNode(QtPropertyEditor::ModelNode& arNode, BSMaterial::LayerID aLayerID)
 	{		
-		BSMaterial::LayerID layerID;
-		if (arNode.QModel() && arNode.GetNativeValue(BSReflection::Ptr(&layerID)))
+		if (aLayerID.QValid())
 		{
-			if (layerID.QValid())
-			{
-				const BSMaterial::HideSoloData hsData = BSMaterial::GetHideSoloData(layerID);
-				arNode.SetShowWarning(hsData.Hide);
+			const BSMaterial::HideSoloData hsData = BSMaterial::GetHideSoloData(aLayerID);
+			arNode.SetShowWarning(hsData.Hide);
 
-				arNode.ForEach([&hsData](QtPropertyEditor::ModelNode& arChild)
-				{
-					arChild.SetShowWarning(hsData.Hide);
-					return BSContainer::ForEachResult::Continue;
-				});
-			}
-		}	
+			arNode.ForEach([&hsData](QtPropertyEditor::ModelNode& arChild)
+			{
+				arChild.SetShowWarning(hsData.Hide);
+				return BSContainer::ForEachResult::Continue;
+			});
+		}
 	}
 
 	/// <summary> Update the contents and selection of the LOD combo box </summary>
@@ -1241,7 +2532,7 @@ namespace SharedTools
 					BSMaterial::Flush();
 					BSMaterial::UpdateLODMaterials(EditedMaterialID, true);
 					UpdateDocumentModified();
-					OnRefreshPropertyEditor();
+					RequestPropertyEditorRefresh(PropertyEditorRefresh::Rebuild, "LOD settings changed");
 				});
 				connect(pdialog, &QDialog::rejected, this, [this]
 				{
@@ -1267,7 +2558,7 @@ namespace SharedTools
 
 			if (previousSubMaterial != EditedSubMaterial)
 			{
-				OnRefreshPropertyEditor();
+				RequestPropertyEditorRefresh(PropertyEditorRefresh::Rebuild, "LOD changed");
 			}
 		}
 		else
@@ -1285,114 +2576,209 @@ namespace SharedTools
 	/// <param name="arNode">The PropertyEditor node for LayerID objects.</param>
 	void MaterialLayeringDialog::BuildIconsForBoundProperties(QtPropertyEditor::QtGenericPropertyEditor* /*apEditor*/, QtPropertyEditor::ModelNode& arNode)
 	{
-		const BSReflection::Attributes& rattribs = arNode.QMetadata();
+		//If we don't have icon metadata, generate it
+		if (IsBindablePropertyNode(arNode) && arNode.QDecorationRoleIcon().isNull())
+		{
+			UpdateBoundPropertyIcon(arNode);
+		}
+	}
+
+	/// <summary> Find the material owning the file of a property node, resolved once per file. </summary>
+	/// <param name="arNode"> Property node. </param>
+	/// <returns> The material, invalid if the file is not a layered material. </returns>
+	BSMaterial::LayeredMaterialID MaterialLayeringDialog::BindingIndex::FindMaterial(QtPropertyEditor::ModelNode& arNode)
+	{
+		BSFilePathString matPath;
+		arNode.QModel()->GetFilename(matPath);
+		const BSFixedString file(matPath.QString());
 
-		if (rattribs.Has<BSReflection::Metadata::MaterialBinding>() || rattribs.Has<BSReflection::Metadata::UVStreamBinding>())
+		auto iter = Materials.find(file);
+		if (iter == Materials.end())
 		{
-			//If we don't have icon metadata, generate it
-			if (arNode.QDecorationRoleIcon().isNull())
-			{
-				arNode.SetDecorationRoleIcon(BindablePropertyIconC);
+			iter = Materials.emplace(file, BSMaterial::FindLayeredMaterialByFile(file.QString())).first;
+		}
 
-				const uint16_t layerIdx = GetLayerIdxFromNode(arNode);
+		return iter->second;
+	}
 
-				BSFilePathString matPath;
-				arNode.QModel()->GetFilename(matPath);
-				const BSMaterial::LayeredMaterialID matID = BSMaterial::FindLayeredMaterialByFile(matPath.QString());
+	/// <summary> Check if a binding of a material layer is bound, scanning the material bindings only the first time. </summary>
+	/// <param name="aMaterial"> Material owning the binding. </param>
+	/// <param name="aUVBinding"> True for UV stream bindings, false for material bindings. </param>
+	/// <param name="aBinding"> Binding to check. </param>
+	/// <param name="aLayerIdx"> Layer index of the binding. </param>
+	/// <param name="arFind"> Scan of the material bindings, returns true if the binding is bound. </param>
+	/// <returns> True if the binding is bound. </returns>
+	template<typename BindingT, typename FindFunctorT>
+	bool MaterialLayeringDialog::BindingIndex::IsBound(BSMaterial::LayeredMaterialID aMaterial, bool aUVBinding, BindingT aBinding, uint16_t aLayerIdx, FindFunctorT&& arFind)
+	{
+		const uint64_t key = (static_cast<uint64_t>(aMaterial.QID().QValue()) << 32) |
+			(aUVBinding ? (1ull << 31) : 0ull) |
+			((static_cast<uint64_t>(aBinding) & 0x7FFF) << 16) |
+			aLayerIdx;
 
-				if (matID.QValid())
-				{
-					const BSReflection::Metadata::UVStreamBinding* puvBindingAttrib = rattribs.Find<BSReflection::Metadata::UVStreamBinding>();
+		auto iter = Bound.find(key);
+		if (iter == Bound.end())
+		{
+			iter = Bound.emplace(key, arFind()).first;
+		}
+
+		return iter->second;
+	}
+
+	/// <summary> Forget the resolved materials and bound states, the bindings or the tree changed. </summary>
+	void MaterialLayeringDialog::BindingIndex::Clear()
+	{
+		Materials.clear();
+		Bound.clear();
+	}
+
+	/// <summary>
+	/// Sets the bindable or bound icon of a bindable property, depending on the current bindings of its material.
+	/// </summary>
+	/// <param name="arNode">The PropertyEditor node of a bindable property.</param>
+	void MaterialLayeringDialog::UpdateBoundPropertyIcon(QtPropertyEditor::ModelNode& arNode)
+	{
+		const BSReflection::Attributes& rattribs = arNode.QMetadata();
+
+		arNode.SetDecorationRoleIcon(BindablePropertyIconC);
+
+		const PropertyNodeContext context = spNodeContexts->Find(arNode);
+		const uint16_t layerIdx = context.LayerIdx;
+		const BSMaterial::LayeredMaterialID matID = BoundProperties.FindMaterial(arNode);
+
+		if (matID.QValid())
+		{
+			const BSReflection::Metadata::UVStreamBinding* puvBindingAttrib = rattribs.Find<BSReflection::Metadata::UVStreamBinding>();
 
-					if (puvBindingAttrib != nullptr)
+			if (puvBindingAttrib != nullptr)
+			{
+				for (const auto& possibleAttributeBinding : puvBindingAttrib->Bindings)
+				{
+					if (BoundProperties.IsBound(matID, true, possibleAttributeBinding, layerIdx,
+						[&]() { return BSMaterialBinding::FindFirstUVBindableProperty(matID, possibleAttributeBinding, layerIdx) != nullptr; }))
 					{
-						for (const auto& possibleAttributeBinding : puvBindingAttrib->Bindings)
-						{
-							if (BSMaterialBinding::FindFirstUVBindableProperty(matID, possibleAttributeBinding, layerIdx) != nullptr)
-							{
-								arNode.SetDecorationRoleIcon(BoundPropertyIconC);
-								break;
-							}
-						}
+						arNode.SetDecorationRoleIcon(BoundPropertyIconC);
+						break;
 					}
+				}
+			}
 
-					const BSReflection::Metadata::MaterialBinding* pmbattrib = rattribs.Find<BSReflection::Metadata::MaterialBinding>();
+			const BSReflection::Metadata::MaterialBinding* pmbattrib = rattribs.Find<BSReflection::Metadata::MaterialBinding>();
 
-					if (pmbattrib != nullptr)
+			if (pmbattrib != nullptr)
+			{
+				for (const auto& possibleAttributeBinding : pmbattrib->Bindings)
+				{
+					if (DoesNodePassBindingViewFilter(possibleAttributeBinding, context.BindingFilter) && BoundProperties.IsBound(matID, false, possibleAttributeBinding, layerIdx,
+						[&]() { return BSMaterialBinding::FindFirstBindableProperty(matID, possibleAttributeBinding, layerIdx) != nullptr; }))
 					{
-						for (const auto& possibleAttributeBinding : pmbattrib->Bindings)
-						{
-							if (DoesNodePassBindingViewFilter(possibleAttributeBinding, arNode) && BSMaterialBinding::FindFirstBindableProperty(matID, possibleAttributeBinding, layerIdx) != nullptr)
-							{
-								arNode.SetDecorationRoleIcon(BoundPropertyIconC);
-								break;
-							}
-						}
+						arNode.SetDecorationRoleIcon(BoundPropertyIconC);
+						break;
 					}
 				}
 			}
 		}
 	}
 
-	/// <summary> Propagate ShaderModel State for widgets to consume. Some state like the number of visible layers
-	/// can only be calculated after applying UI processors, but widgets gets constructed before that.</summary>
-	void MaterialLayeringDialog::PropagateShaderModelState()
+	/// <summary>
+	/// Run every post build stage of the property editor in a single pass over the top level nodes: layer shortcuts, patchable nodes
+	/// and the Shader Model State propagation. The layer node UI and bound property icons are editor post processors instead. Some state like the number of visible layers can only be calculated after applying
+	/// UI processors, but widgets gets constructed before that. The children of the top level nodes are processed when they get expanded.
+	/// </summary>
+	void MaterialLayeringDialog::ProcessPropertyTree()
 	{
 		LayerNameToNumkeyMap.clear();
+		LayerNodes.clear();
+		BindableNodePaths.clear();
+		DeferredPropertyNodes.clear();
+		RemainingLayersToBind = MaterialSMState.LayerCount;
+		std::fill(std::begin(LayerShortcutRows), std::end(LayerShortcutRows), -1);
 
 		auto pnode = ui.treeViewPropEditor->QTreeNode();
 		if (pnode)
 		{
-			using namespace SharedTools;
-			using namespace QtPropertyEditor;
+			ProcessPropertyNodes(*pnode, true);
+		}
+	}
+
+	/// <summary>
+	/// Run the post build stages on the direct children of a node. The children are deferred: their own children are processed
+	/// once they get expanded.
+	/// </summary>
+	/// <param name="arParentNode"> Node whose children are processed. </param>
+	/// <param name="aProcessParent"> If true, the node itself is processed too. </param>
+	void MaterialLayeringDialog::ProcessPropertyNodes(QtPropertyEditor::ModelNode& arParentNode, bool aProcessParent)
+	{
+		using namespace SharedTools;
+		using namespace QtPropertyEditor;
+
+		// The children inherit the same context, it is derived once from the parent.
+		const PropertyNodeContext childContext = InheritPropertyNodeContext(spNodeContexts->Find(arParentNode), arParentNode);
 
-			uint32_t remainingLayersToBind = MaterialSMState.LayerCount;
+		PropertyTreePass pass;
+		pass.OnEnterNode([this, &childContext](ModelNode& arNode) { spNodeContexts->Add(arNode, childContext); });
 
-			// Apply state where there is a consumer widget that wants it.
-			pnode->ApplyRecursively(
-				[this, &remainingLayersToBind](ModelNode& arNode)
+		// Remember the nodes an incremental refresh patches in place, by data path as the editor may rebuild them.
+		pass.OnModelNode([this](ModelNode& arNode)
+		{
+			if (IsBindablePropertyNode(arNode))
 			{
-				for (auto columnId = ToUnderlyingType<ModelNode::Column>(ModelNode::Column::Name);
-					columnId < ToUnderlyingType<ModelNode::Column>(ModelNode::Column::Count); columnId++)
-				{
-					QWidget* pwidgetAtColumn = arNode.QPersistentWidget(FromUnderlyingType<ModelNode::Column>(columnId));
-					if (pwidgetAtColumn)
-					{
-						disconnect(pwidgetAtColumn);
+				BindableNodePaths.emplace_back(arNode.QDataPath().QString());
+			}
+		});
+		pass.OnLayerNode([this](ModelNode& arNode, BSMaterial::LayerID aLayerID)
+		{
+			const bool hidden = aLayerID.QValid() && BSMaterial::GetHideSoloData(aLayerID).Hide;
+			LayerNodes.push_back({ aLayerID, BSFixedString(arNode.QDataPath().QString()), hidden });
+		});
 
-						IShaderModelStateConsumer* pconsumer = dynamic_cast<IShaderModelStateConsumer*>(pwidgetAtColumn);
-						if (pconsumer != nullptr)
-						{
-							pconsumer->ProcessShaderModelState(MaterialSMState);
-						}
-					}
-				}
+		// Map the visible layers to their ALT+Numkey shortcut.
+		pass.OnLayerNode([this](ModelNode& arNode, BSMaterial::LayerID /*aLayerID*/)
+		{
+			uint32_t numkey = RemainingLayersToBind;
 
-				if (arNode.QModel())
-				{
-					// Test for Layer
-					BSMaterial::LayerID layerID;
+			if (numkey == BSMaterial::MaxLayerCountC)
+			{
+				numkey = 0; // ie Layer10 => zero 0 numkey
+			}
 
-					if (arNode.GetNativeValue(BSReflection::Ptr(&layerID)))
-					{
-						uint32_t numkey = remainingLayersToBind;
+			std::string layerName = std::string(arNode.QName());
 
-						if (numkey == BSMaterial::MaxLayerCountC)
-						{
-							numkey = 0; // ie Layer10 => zero 0 numkey
-						}
+			auto pair = std::make_pair(layerName, numkey);
+			LayerNameToNumkeyMap.insert(pair);
 
-						std::string layerName = std::string(arNode.QName());
+			--RemainingLayersToBind;
+		});
 
-						auto pair = std::make_pair(layerName, numkey);
-						LayerNameToNumkeyMap.insert(pair);
+		// Apply state where there is a consumer widget that wants it.
+		pass.OnWidget([this](ModelNode& /*arNode*/, ModelNode::Column /*aColumn*/, QWidget* apWidget)
+		{
+			IShaderModelStateConsumer* pconsumer = dynamic_cast<IShaderModelStateConsumer*>(apWidget);
+			if (pconsumer != nullptr)
+			{
+				pconsumer->ProcessShaderModelState(MaterialSMState);
+			}
+		});
 
-						--remainingLayersToBind;
-					}
-				}
+		pass.OnAnyNode([this](ModelNode& arNode) { InitializeMaterialLayerButtonsCallbacks(arNode); });
+		pass.OnAnyNode([this](ModelNode& arNode) { DeferredPropertyNodes.insert(BSFixedString(arNode.QDataPath().QString())); });
 
-				InitializeMaterialLayerButtonsCallbacks(arNode);
-			});
+		if (aProcessParent)
+		{
+			pass.VisitNode(arParentNode);
+		}
+		pass.VisitChildren(arParentNode);
+		DeferredPropertyNodes.erase(BSFixedString(arParentNode.QDataPath().QString()));
+	}
+
+	/// <summary> SLOT: Called when a property node is expanded, processes its children the first time. </summary>
+	/// <param name="aIndex"> Index of the expanded node. </param>
+	void MaterialLayeringDialog::OnPropertyNodeExpanded(const QModelIndex& aIndex)
+	{
+		QtPropertyEditor::ModelNode* pnode = ui.treeViewPropEditor->GetNode(aIndex);
+		if (pnode != nullptr && DeferredPropertyNodes.erase(BSFixedString(pnode->QDataPath().QString())) > 0)
+		{
+			ProcessPropertyNodes(*pnode, false);
 		}
 	}
 
@@ -1408,7 +2794,16 @@ namespace SharedTools
 				BSMaterial::Internal::QDBStorage().RequestDestroyFileObjects(EditedMaterialID.QID());
 			}
 
+			CloseEditJournal();
 			ui.treeViewPropEditor->ClearPropertyEditor();
+			PendingRefreshes.PropertyEditor = false;
+			PendingRefreshes.Preview = false;
+			LayerNodes.clear();
+			BindableNodePaths.clear();
+			BoundProperties.Clear();
+			spNodeContexts->Contexts.clear();
+			DeferredPropertyNodes.clear();
+			BuiltTreeSignature = PropertyTreeSignature{};
 			EditedMaterialID = EditedSubMaterial = BSMaterial::LayeredMaterialID{};
 			UpdateDocumentModified();
 			// Make sure to flush the shader model state.
@@ -1503,8 +2898,11 @@ namespace SharedTools
 		connect(ui.lodCombo, QOverload<int32_t>::of(&QComboBox::currentIndexChanged), this, &MaterialLayeringDialog::OnLODChanged);
 
 		connect(ui.treeViewPropEditor, &QtPropertyEditor::QtGenericPropertyEditor::ForcedRefresh, this, &MaterialLayeringDialog::OnRefreshPropertyEditor);
+		connect(ui.treeViewPropEditor, &QTreeView::expanded, this, &MaterialLayeringDialog::OnPropertyNodeExpanded);
 		connect(ui.treeViewPropEditor, &QtPropertyEditor::QtGenericPropertyEditor::ChildPropertyChanging, this, &MaterialLayeringDialog::OnPropertyChanging);
-		connect(ui.treeViewPropEditor, &QtPropertyEditor::QtGenericPropertyEditor::ChildPropertyChanged, this, &MaterialLayeringDialog::OnMaterialPropertyChanged);
+		connect(ui.treeViewPropEditor, &QtPropertyEditor::QtGenericPropertyEditor::ChildPropertyChanged, this, &MaterialLayeringDialog::RequestMaterialChangeNotification);
+		PropertyChangeTimer.setSingleShot(true);
+		connect(&PropertyChangeTimer, &QTimer::timeout, this, &MaterialLayeringDialog::OnPropertyChangeTimer);
 		connect(ui.treeViewPropEditor, &QWidget::customContextMenuRequested, this, &MaterialLayeringDialog::OnPropertyContextMenuRequest);
 
 		connect(&RefreshTimer, &QTimer::timeout, this, &MaterialLayeringDialog::RenderPreview);
@@ -1549,6 +2947,15 @@ namespace SharedTools
 
 		QShortcut *paddNewLayerShortcut = new QShortcut(QKeySequence("CTRL+A"), this);
 		connect(paddNewLayerShortcut, &QShortcut::activated, this, &MaterialLayeringDialog::OnAddLayer);
+
+		// ALT+Numkey => navigate to layer widget. The shortcuts live as long as the dialog, rebuilds only retarget their layer row.
+		for (uint32_t numkey = 0; numkey < LayerShortcutCountC; ++numkey)
+		{
+			LayerShortcutRows[numkey] = -1;
+
+			QShortcut* pnavigateToLayerShortcut = new QShortcut(QKeySequence(QString("ALT+%1").arg(numkey)), this);
+			connect(pnavigateToLayerShortcut, &QShortcut::activated, this, [this, numkey]() { NavigateToLayer(numkey); });
+		}
 	}
 
 	/// <summary>
@@ -1562,23 +2969,10 @@ namespace SharedTools
 
 		if (pWidget != nullptr)
 		{
-			connect(this, &MaterialLayeringDialog::SoloViewLayer, pWidget, &QtPropertyEditor::MaterialLayerButtonsWidget::OnSoloViewLayer);
-			connect(pWidget, &QtPropertyEditor::MaterialLayerButtonsWidget::HideClicked,
-				[this](bool /*aPressed*/)
-				{
-					BSMaterial::Flush();
-					OnMaterialPropertyChanged();
-					OnRefreshPropertyEditor();
-				});
-
-			connect(pWidget, &QtPropertyEditor::MaterialLayerButtonsWidget::SoloClicked,
-				[this](QWidget* apSender, bool aPressed)
-				{
-					emit SoloViewLayer(apSender, aPressed);
-					BSMaterial::Flush();
-					OnMaterialPropertyChanged();
-					OnRefreshPropertyEditor();
-				});
+			// Persistent widgets can be processed again by later rebuilds, unique connections keep a single binding per widget.
+			connect(this, &MaterialLayeringDialog::SoloViewLayer, pWidget, &QtPropertyEditor::MaterialLayerButtonsWidget::OnSoloViewLayer, Qt::UniqueConnection);
+			connect(pWidget, &QtPropertyEditor::MaterialLayerButtonsWidget::HideClicked, this, &MaterialLayeringDialog::OnLayerHideClicked, Qt::UniqueConnection);
+			connect(pWidget, &QtPropertyEditor::MaterialLayerButtonsWidget::SoloClicked, this, &MaterialLayeringDialog::OnLayerSoloClicked, Qt::UniqueConnection);
 
 			BSMaterial::LayerID layerID;
 			
@@ -1586,29 +2980,50 @@ namespace SharedTools
 			{
 				auto iter = LayerNameToNumkeyMap.find(arModelNode.QName());
 
-				if (iter != LayerNameToNumkeyMap.end())
-				{
-					//ALT+Numkey => navigate to layer widget
-					const QString altNumkeyString = QString("ALT+%1").arg(iter->second);
-					const uint32_t rowIndex = arModelNode.QRow();
+				if (iter != LayerNameToNumkeyMap.end() && iter->second < LayerShortcutCountC)
+				{
+					LayerShortcutRows[iter->second] = static_cast<int32_t>(arModelNode.QRow());
+				}
+			}
+		}
+	}
+
+	/// <summary> SLOT: Called when the hide button of a layer is clicked </summary>
+	/// <param name="aPressed"> Unused. </param>
+	void MaterialLayeringDialog::OnLayerHideClicked(bool /*aPressed*/)
+	{
+		BSMaterial::Flush();
+		OnMaterialPropertyChanged();
+		RequestPropertyEditorRefresh(PropertyEditorRefresh::Incremental, "Layer hide toggled");
+	}
 
-					QShortcut* pnavigateToLayerShortcut = new QShortcut(QKeySequence(altNumkeyString), pWidget);
+	/// <summary> SLOT: Called when the solo button of a layer is clicked, only one layer can be solo at a time </summary>
+	/// <param name="apSender"> Layer buttons widget that was clicked. </param>
+	/// <param name="aPressed"> If true, the layer is now solo. </param>
+	void MaterialLayeringDialog::OnLayerSoloClicked(QWidget* apSender, bool aPressed)
+	{
+		emit SoloViewLayer(apSender, aPressed);
+		BSMaterial::Flush();
+		OnMaterialPropertyChanged();
+		RequestPropertyEditorRefresh(PropertyEditorRefresh::Incremental, "Layer solo toggled");
+	}
 
-					connect(pnavigateToLayerShortcut, &QShortcut::activated, pWidget,
-						[this, rowIndex]()
-						{
-							const QModelIndex modelIndex = ui.treeViewPropEditor->model()->index(rowIndex, 0);
+	/// <summary> Select, scroll to and expand the layer bound to an ALT+Numkey shortcut </summary>
+	/// <param name="aNumkey"> Numkey of the shortcut. </param>
+	void MaterialLayeringDialog::NavigateToLayer(uint32_t aNumkey)
+	{
+		const int32_t rowIndex = LayerShortcutRows[aNumkey];
+		if (rowIndex >= 0)
+		{
+			const QModelIndex modelIndex = ui.treeViewPropEditor->model()->index(rowIndex, 0);
 
-							QItemSelectionModel* pselection = ui.treeViewPropEditor->selectionModel();
-							pselection->select(modelIndex, QItemSelectionModel::Select);
+			QItemSelectionModel* pselection = ui.treeViewPropEditor->selectionModel();
+			pselection->select(modelIndex, QItemSelectionModel::Select);
 
-							ui.treeViewPropEditor->scrollTo(modelIndex);
-							ui.treeViewPropEditor->expand(modelIndex);
-						});
-				}
+			ui.treeViewPropEditor->scrollTo(modelIndex);
+			ui.treeViewPropEditor->expand(modelIndex);
 		}
 	}
-	}
 
 
 	/// <summary>
@@ -1728,13 +3143,28 @@ namespace SharedTools
 	void MaterialLayeringDialog::ApplyShaderModel(const char* apShaderModel)
 	{
 		using namespace QtPropertyEditor;
-		// Try to find the rule processor.
-		std::shared_ptr<RuleProcessor> processorToApply = SharedTools::GetShaderModelRuleProcessor(BSFixedString(apShaderModel));
-		BSWARNING_IF(processorToApply == nullptr, WARN_DEFAULT, "Cannot assign Invalid shader model (%s) to Property Editor.", apShaderModel);
-		if (processorToApply)
+		const BSFixedString shaderModelName(apShaderModel);
+
+		// Prefer the rules compiled when the templates were loaded, the rule processor interprets the template json on every node.
+		const SharedTools::ShaderModelProcessorList* pcompiledRules = SharedTools::GetShaderModelCompiledRules(shaderModelName);
+		if (pcompiledRules != nullptr)
+		{
+			auto& processors = ui.treeViewPropEditor->QProcessors();
+			processors.insert(processors.end(), pcompiledRules->begin(), pcompiledRules->end());
+			AppliedShaderModel = shaderModelName;
+		}
+		else
 		{
-			ui.treeViewPropEditor->QProcessors().emplace_back(processorToApply);
+			// Try to find the rule processor.
+			std::shared_ptr<RuleProcessor> processorToApply = SharedTools::GetShaderModelRuleProcessor(shaderModelName);
+			BSWARNING_IF(processorToApply == nullptr, WARN_DEFAULT, "Cannot assign Invalid shader model (%s) to Property Editor.", apShaderModel);
+			if (processorToApply)
+			{
+				ui.treeViewPropEditor->QProcessors().emplace_back(processorToApply);
+				AppliedShaderModel = shaderModelName;
+			}
 		}
+		AppliedShaderModelRevision = SharedTools::QShaderModelTemplateRevision();
 	}
 
 	/// <summary> SLOT: Updates the preview object and renders it. </summary>
@@ -1821,10 +3251,11 @@ namespace SharedTools
 				BSMaterial::Internal::QDBStorage().RequestClaimTransientObjects(EditedMaterialID.QID());
 				BSMaterial::Flush();
 				// Destroyed on close.
-				QtBoundPropertyDialog* pdialog = new QtBoundPropertyDialog(this, EditedMaterialID, stl::make_unique<MaterialPropertySelectModel>(EditedMaterialID), true);
+				auto spselectModel = stl::make_unique<MaterialPropertySelectModel>(EditedMaterialID);
+				QtBoundPropertyDialog* pdialog = new QtBoundPropertyDialog(this, EditedMaterialID, std::move(spselectModel), true);
 				pdialog->setAttribute(Qt::WA_DeleteOnClose);
 				connect(pdialog, &QDialog::accepted, this, &MaterialLayeringDialog::OnMaterialPropertyChanged);
-				connect(pdialog, &QDialog::accepted, this, &MaterialLayeringDialog::OnRefreshPropertyEditor);
+				connect(pdialog, &QDialog::accepted, this, [this] { RequestPropertyEditorRefresh(PropertyEditorRefresh::IncrementalBindings, "Material bindings published"); });
 				connect(pdialog, &QtBoundPropertyDialog::ControllerRefreshed, this, &MaterialLayeringDialog::OnMaterialPropertyControllerRefreshed);
 				pdialog->show();
 			}
@@ -1847,12 +3278,18 @@ namespace SharedTools
 			{
 				BSMaterial::Flush();
 
-				UndoCallback execute = [this](void* apData) { RestoreMaterialBackup(apData); };
-				UndoCallback revert = [this](void* apData) { RemoveLastLayer(apData); };
+				UndoCallback execute = [this](UndoPayload* apData) { RestoreLayer(apData); };
+				UndoCallback revert = [this](UndoPayload* apData) { RemoveLayer(apData); };
+
+				// Back up the newly-added layer only, the first execution finds it present and does nothing.
+				MakeNewUndoCommand(std::move(revert), std::move(execute), CaptureTopLayer(EditedMaterialID));
 
-				// Create a backup with the newly-added layer
-				Json::Value* pmaterialBackup = CreateMaterialBackup();
-				MakeNewUndoCommand(std::move(revert), std::move(execute), pmaterialBackup);
+				if (spEditJournal && !ReplayingJournal)
+				{
+					spEditJournal->Append(EditJournal::RecordKind::LayerAdded);
+				}
+				RequestMaterialChangeNotification();
+				RequestPropertyEditorRefresh(PropertyEditorRefresh::Incremental, "Layer added");
 			}
 		}
 	}
@@ -1860,54 +3297,70 @@ namespace SharedTools
 	/// <summary> SLOT: Called when the "Remove Last Layer" button is pressed </summary>
 	void MaterialLayeringDialog::OnRemoveLayer()
 	{
-		UndoCallback execute = [this](void* apData) { RemoveLastLayer(apData); };
-		UndoCallback revert = [this](void* apData) { RestoreMaterialBackup(apData); };
-
-		Json::Value* pmaterialBackup = CreateMaterialBackup();
-		MakeNewUndoCommand(std::move(revert), std::move(execute), pmaterialBackup);
-	}
-
-	/// <summary> Saves the current state of the current material </summary>
-	/// <returns> A Json object suitable for passing to RestoreMaterialBackup() to restore the material's settings at a future time </returns>
-	Json::Value* MaterialLayeringDialog::CreateMaterialBackup()
-	{
-		Json::Value* pmaterialBackup = new Json::Value();
-		BSMaterial::Internal::QDB2Instance().RequestExecuteForCreateAndDelete([this, pmaterialBackup](BSComponentDB2::CreateAndDeleteInterface& arInterface)
+		// Back up the top layer only, the first execution removes it.
+		std::unique_ptr<LayerUndoDelta> spdelta = CaptureTopLayer(EditedMaterialID);
+		if (spdelta != nullptr)
 		{
-			BSMaterial::Internal::QDBStorage().SaveJson(arInterface, EditedMaterialID, *pmaterialBackup);
-		});
-
-		return pmaterialBackup;
+			UndoCallback execute = [this](UndoPayload* apData) { RemoveLayer(apData); };
+			UndoCallback revert = [this](UndoPayload* apData) { RestoreLayer(apData); };
+			MakeNewUndoCommand(std::move(revert), std::move(execute), std::move(spdelta));
+		}
 	}
 
-	/// <summary> Remove the last layer on the Material Layer stack </summary>
-	void MaterialLayeringDialog::RemoveLastLayer(void* /*apData*/)
+	/// <summary> Remove the layer backed up in an undo delta from the top of the Material Layer stack </summary>
+	/// <param name="apData"> The LayerUndoDelta created by CaptureTopLayer() </param>
+	void MaterialLayeringDialog::RemoveLayer(UndoPayload* apData)
 	{
-		CursorScope cursor(Qt::WaitCursor);
-		if (BSMaterial::RemoveLastLayer(EditedMaterialID))
+		LayerUndoDelta* pdelta = static_cast<LayerUndoDelta*>(apData);
+		BSASSERT(pdelta != nullptr, "pdelta was unexecpectedly null");
+		if (pdelta != nullptr && pdelta->Present)
 		{
-			OnMaterialPropertyChanged();
-			OnRefreshPropertyEditor();
+			CursorScope cursor(Qt::WaitCursor);
+			if (BSMaterial::RemoveLastLayer(EditedMaterialID))
+			{
+				if (spEditJournal && !ReplayingJournal)
+				{
+					spEditJournal->Append(EditJournal::RecordKind::LayerRemoved);
+				}
+
+				pdelta->Present = false;
+				RequestMaterialChangeNotification();
+				RequestPropertyEditorRefresh(PropertyEditorRefresh::Incremental, "Last layer removed");
+			}
 		}
 	}
 
-	/// <summary> Restore a material's settings to those captured with an earlier call to CreateMaterialBackup() </summary>
-	/// <param name="apData"> A Json object containing the settings to apply to the material. This object is typically created by calling CreateMaterialBackup() </param>
-	void MaterialLayeringDialog::RestoreMaterialBackup(void* apData)
+	/// <summary> Add back the layer backed up in an undo delta on top of the Material Layer stack, loading only that layer and its blender </summary>
+	/// <param name="apData"> The LayerUndoDelta created by CaptureTopLayer() </param>
+	void MaterialLayeringDialog::RestoreLayer(UndoPayload* apData)
 	{
-		const Json::Value *pmaterialData = static_cast<Json::Value*>(apData);
-		BSASSERT(pmaterialData != nullptr, "pmaterialData was unexecpectedly null");
-		if (pmaterialData != nullptr)
+		LayerUndoDelta* pdelta = static_cast<LayerUndoDelta*>(apData);
+		BSASSERT(pdelta != nullptr, "pdelta was unexecpectedly null");
+		if (pdelta != nullptr && !pdelta->Present)
 		{
 			CursorScope cursor(Qt::WaitCursor);
-
-			BSMaterial::Internal::QDB2Instance().RequestExecuteForCreateAndDelete([this, pmaterialData](BSComponentDB2::CreateAndDeleteInterface& arInterface)
+			if (BSMaterial::AddNewLayer(EditedMaterialID))
 			{
-				BSMaterial::Internal::QDBStorage().LoadJson(arInterface, EditedMaterialID, *pmaterialData);
-			});
+				BSMaterial::Flush();
+				if (LoadTopLayer(EditedMaterialID, pdelta->LayerIndex, pdelta->Layer, pdelta->Blender))
+				{
+					if (spEditJournal && !ReplayingJournal)
+					{
+						const QStringList serialized = { QString::fromStdString(pdelta->Layer.toStyledString()), QString::fromStdString(pdelta->Blender.toStyledString()) };
+						spEditJournal->Append(EditJournal::RecordKind::LayerRestored, QString(), serialized);
+					}
 
-			OnMaterialPropertyChanged();
-			OnRefreshPropertyEditor();
+					pdelta->Present = true;
+					RequestMaterialChangeNotification();
+					RequestPropertyEditorRefresh(PropertyEditorRefresh::Incremental, "Layer restored");
+				}
+				else
+				{
+					// The layer did not land in the slot it was removed from, refuse the restore.
+					BSMaterial::RemoveLastLayer(EditedMaterialID);
+					BSMaterial::Flush();
+				}
+			}
 		}
 	}
 
@@ -1976,7 +3429,7 @@ namespace SharedTools
 		ui.syncTexturesButton->setDisabled(false);
 
 		// Refresh to let the newly synced textures show up (in the texture widget preview)
-		OnRefreshPropertyEditor();
+		RequestPropertyEditorRefresh(PropertyEditorRefresh::Rebuild, "Textures synced");
 	}
 
 	/// <summary> Checks out the currently edited material and all sub-assets in Perforce </summary>
@@ -2056,7 +3509,7 @@ namespace SharedTools
 			}
 		}
 
-		ui.pMaterialBrowserWidget->Refresh();
+		RequestBrowserRefresh("Files checked out");
 
 		return filesCheckedOut;
 	}
@@ -2179,8 +3632,6 @@ namespace SharedTools
 			// On Accept Button
 			connect(pdialog, &QDialog::accepted, this, [this, pdialog, aMaterialToProcess, materials = std::move(affectedMaterials)]()
 			{
-				SharedTools::CursorScope cursor(Qt::WaitCursor);
-
 				QTreeWidget* pWidget = pdialog->QTreeWidget();
 				BSASSERTFAST(pWidget);
 				const uint32_t rootMaterialId = pWidget->currentItem()->data(0, CustomRoles::MaterialID).toUInt();
@@ -2197,32 +3648,44 @@ namespace SharedTools
 					aMaterialToProcess, srcMaterialName.QString(), currentSM.FileName.QString(),
 					rootMaterialId, destMaterialName.QString(), destinationSM.FileName.QString());
 
-				BSMaterial::ChangeShaderModel(aMaterialToProcess, shaderModelRootMaterial);
-				pUndoRedoStack->clear();
-				UpdateDocumentModified();
-					
-				// Disable all processors including the Shader Model processor while we migrate the properties 
-				// (we have to compare model nodes with the older shader model manually applied)
-				UIProcessorsActive = false;
+				// Dry run of the migration, so the user knows what will be reverted before committing to it.
+				stl::vector<BSString> revertedProperties;
+				SharedTools::ReportShaderModelMigration(aMaterialToProcess, shaderModelRootMaterial, revertedProperties);
+				bool confirmed = true;
+				if (!revertedProperties.empty())
+				{
+					QString details;
+					for (const BSString& rproperty : revertedProperties)
+					{
+						details += QString("%1\n").arg(rproperty.QString());
+					}
 
-				// Make sure to refresh the underlying views with updated new root material parent, this will enable us to revert
-				// the properties to data parent with the right parents loaded in the model node views. 
-				OnRefreshPropertyEditor();
-				// Process individual properties. Properties not found in destination shader models are reverted to data parent.
-				SharedTools::MigrateShaderModelProperties(*ui.treeViewPropEditor->QTreeNode(), shaderModelRootMaterial);
+					QMessageBox confirmBox(QMessageBox::Warning, pDialogTitleC,
+						QString("Switching to %1 will revert %2 properties to their default value.\nDo you want to continue ?").arg(destinationSM.FileName.QString()).arg(revertedProperties.size()),
+						QMessageBox::Yes | QMessageBox::No, this);
+					confirmBox.setDetailedText(details);
+					confirmed = confirmBox.exec() == QMessageBox::Yes;
+				}
 
-				// Enable UI processors being applied, we want the new shader model to be applied on migrated Material.
-				UIProcessorsActive = true;
+				if (confirmed)
+				{
+					SharedTools::CursorScope cursor(Qt::WaitCursor);
 
-				// Save all affected materials
-				bool allMaterialsSaved = BSMaterial::Save(materials);
+					// Switch and migrate the material off the property editor. Properties not found in destination shader models are reverted
+					// to data parent, then all affected materials are saved.
+					BSTArray<BSMaterial::LayeredMaterialID> materialsToMigrate;
+					materialsToMigrate.Add(aMaterialToProcess);
+					bool allMaterialsSaved = SharedTools::MigrateMaterialsToShaderModel(materialsToMigrate, shaderModelRootMaterial, materials);
 
-				OnRefreshPropertyEditor();
+					pUndoRedoStack->clear();
+					UpdateDocumentModified();
+					RequestPropertyEditorRefresh(PropertyEditorRefresh::Rebuild, "Shader model switched");
 
-				if (!allMaterialsSaved)
-				{
-					QApplication::restoreOverrideCursor();
-					QMessageBox::critical(this, pDialogTitleC, "Some materials failed to save\nCheck the log for details\nYou're recommended to revert all open changes now");
+					if (!allMaterialsSaved)
+					{
+						QApplication::restoreOverrideCursor();
+						QMessageBox::critical(this, pDialogTitleC, "Some materials failed to save\nCheck the log for details\nYou're recommended to revert all open changes now");
+					}
 				}
 			});
 			pdialog->show();
@@ -2415,7 +3878,7 @@ namespace SharedTools
 	void MaterialLayeringDialog::OnReparentMaterial(BSMaterial::LayeredMaterialID aParentMaterial)
 	{
 		ReparentMaterial(this, EditedMaterialID, aParentMaterial);
-		OnRefreshPropertyEditor();
+		RequestPropertyEditorRefresh(PropertyEditorRefresh::Rebuild, "Material reparented");
 	}
 
 	/// <summary> SLOT: Called when OnRequestMultipleReparentToMaterial happens from the Material Browser context menu. </summary>
@@ -2544,7 +4007,7 @@ namespace SharedTools
 		{
 			if (aTargetMaterial == EditedMaterialID)
 			{
-				OnRefreshPropertyEditor();
+				RequestPropertyEditorRefresh(PropertyEditorRefresh::Rebuild, "Material reparented");
 			}
 		}
 
@@ -2609,7 +4072,11 @@ namespace SharedTools
 			if (filesCheckedOut.QSize() != 0)
 			{
 				// Save the active material
-				bool saved = BSMaterial::Save(EditedMaterialID);
+				bool saved = false;
+				{
+					MaterialSaveScope saving(SavingMaterials);
+					saved = BSMaterial::Save(EditedMaterialID);
+				}
 		
 				if(saved)
 				{
@@ -2630,7 +4097,7 @@ namespace SharedTools
 				}
 
 				// Since we may purge unused assets during the Save() we should refresh the UI so those assets don't show up in the DBObjectWidgets
-				OnRefreshPropertyEditor();
+				RequestPropertyEditorRefresh(PropertyEditorRefresh::Rebuild, "Material saved");
 				result = saved;
 			}
 		}
@@ -2747,7 +4214,7 @@ namespace SharedTools
 				}
 				else
 				{
-					OnRefreshPropertyEditor();
+					RequestPropertyEditorRefresh(PropertyEditorRefresh::Rebuild, "Material saved as");
 				}
 			}
 		}
@@ -2756,7 +4223,9 @@ namespace SharedTools
 	}
 
 	/// <summary>
-	/// SLOT: Save all the layered materials in the project.
+	/// SLOT: Save all the layered materials in the project. The materials are checked out, then saved in shards of
+	/// SaveAllShardSizeC with the progress reported between shards, so the save can be canceled. Data parents and children
+	/// are saved in the same shard, and the refreshes wait for the end of the save since reporting the progress runs the event loop.
 	/// </summary>
 	/// <returns>True if all materials were successfully saved.</returns>
 	bool MaterialLayeringDialog::SaveAll()
@@ -2765,7 +4234,14 @@ namespace SharedTools
 
 		if(QMessageBox::information(this, "Save All", "You are about to save all the materials in the project. This could take a while. Proceed?", QMessageBox::Yes | QMessageBox::No) == QMessageBox::Yes)
 		{
-			CursorScope cursor(Qt::WaitCursor);
+			PendingRefreshes.Suspended = true;
+			const bool previewing = RefreshTimer.isActive();
+			RefreshTimer.stop();
+
+			QProgressDialog progress("Checking out materials...", "Cancel", 0, 0, this);
+			progress.setWindowModality(Qt::WindowModal);
+			progress.setMinimumDuration(0);
+			progress.setValue(0);
 
 			// Get currently checked out files.
 			stl::scrap_set<BSFixedString> filesCheckedOut;
@@ -2803,19 +4279,48 @@ namespace SharedTools
 			const uint32_t changelistNumber = FindOrCreateChangelist(sMaterialDefaultChangeListDesc.String());
 			SharedTools::CheckoutFiles(this, pDialogTitleC, pathsToCheckout, SharedTools::CheckOutFailedOption::TryAdd, SharedTools::VerbosityOption::Verbose, changelistNumber);
 			
-			// Save whole material list.
-			if (allMaterials.QSize() > 0)
-			{
-				result = BSMaterial::Save(allMaterials);
+			// Save the material list shard by shard, each shard saves its materials as one batch.
+			const uint32_t materialCount = allMaterials.QSize();
+			progress.setLabelText("Saving materials...");
+			progress.setMaximum(static_cast<int32_t>(materialCount));
+			const stl::vector<BSTArray<BSMaterial::LayeredMaterialID>> shards = MakeSaveShards(allMaterials, SaveAllShardSizeC);
 
-				if (!result)
+			result = true;
+			uint32_t savedCount = 0;
+			uint32_t failedShardCount = 0;
+			for (size_t i = 0; i < shards.size() && !progress.wasCanceled(); i++)
+			{
+				MaterialSaveScope saving(SavingMaterials);
+				if (!BSMaterial::Save(shards[i]))
 				{
-					QMessageBox::critical(this, pDialogTitleC, "Failed to save all materials");
+					result = false;
+					failedShardCount++;
 				}
-			}		
+
+				savedCount += shards[i].QSize();
+				progress.setLabelText(QString::asprintf("Saving materials... (%u/%u)", savedCount, materialCount));
+				progress.setValue(static_cast<int32_t>(savedCount));
+			}
+			progress.setValue(static_cast<int32_t>(materialCount));
+
+			if (savedCount < materialCount)
+			{
+				result = false;
+				QMessageBox::warning(this, pDialogTitleC, QString::asprintf("Save All canceled, %u of %u materials were not saved.", materialCount - savedCount, materialCount));
+			}
+			if (failedShardCount > 0)
+			{
+				QMessageBox::critical(this, pDialogTitleC, QString::asprintf("Failed to save all materials, %u batches of materials failed.", failedShardCount));
+			}
+
+			PendingRefreshes.Suspended = false;
+			if (previewing)
+			{
+				RefreshTimer.start();
+			}
 		}
 
-		OnRefreshPropertyEditor();
+		RequestPropertyEditorRefresh(PropertyEditorRefresh::Rebuild, "All materials saved");
 
 		return result;
 	}
@@ -2885,6 +4390,7 @@ namespace SharedTools
 		{
 			CursorScope cursor(Qt::WaitCursor);
 			loadSuccess = BSMaterial::LoadAll();
+			SharedTools::InvalidateShaderModelPropertyMasks();
 		}
 		if (loadSuccess)
 		{
@@ -2912,7 +4418,7 @@ namespace SharedTools
 			QMessageBox::information(this, pDialogTitleC, QString::asprintf("%s%s", syncSummary.QString(), loadResultMessage.toLatin1().data()));
 		}
 
-		OnRefreshPropertyEditor();
+		RequestPropertyEditorRefresh(PropertyEditorRefresh::Rebuild, "Materials synced");
 	}
 
 	/// <summary> SLOT: Sync all materials and reload them </summary>
@@ -3000,7 +4506,7 @@ namespace SharedTools
 
 			if(!aborted && SharedTools::CheckinFiles(this, pDialogTitleC, filesToCheckIn))
 			{
-				ui.pMaterialBrowserWidget->Refresh();
+				RequestBrowserRefresh("Files checked in");
 			}
 		}
 	}
@@ -3031,7 +4537,7 @@ namespace SharedTools
 			spperforce->AddFile(aFile, changelistNumber);
 			QtPerforceFileInfoCache::QInstance().UpdateCacheAsync(aFile.QString());
 
-			ui.pMaterialBrowserWidget->Refresh();
+			RequestBrowserRefresh("File marked for add");
 		}
 	}
 
@@ -3337,7 +4843,7 @@ namespace SharedTools
 
 								rstorage.RequestDestroyFileObjects(object);
 								BSMaterial::Flush();
-								ui.pMaterialBrowserWidget->Refresh();
+								RequestBrowserRefresh("File deleted");
 								deleteHappened = true;
 							}
 						}
@@ -3578,7 +5084,7 @@ namespace SharedTools
 							}
 
 							BSMaterial::Flush();
-							ui.pMaterialBrowserWidget->Refresh();
+							RequestBrowserRefresh("File renamed");
 
 							loop = false;
 						}
@@ -3646,9 +5152,10 @@ namespace SharedTools
 
 			// Reload all assets
 			BSMaterial::LoadAll();
+			SharedTools::InvalidateShaderModelPropertyMasks();
 
 			// Update the UI
-			OnRefreshPropertyEditor();
+			RequestPropertyEditorRefresh(PropertyEditorRefresh::Rebuild, "Files reverted");
 		}
 	}
 
@@ -3721,9 +5228,13 @@ namespace SharedTools
 		BSMaterial::Internal::QDBStorage().NotifyObjectModified(EditedMaterialID);
 		BSMaterial::MaterialChangeNotifyService::QInstance().Flush();
 
+		// A layer slot may have been assigned, the layer buttons depend on it.
+		UpdateMaterialShaderModelState();
+		UpdateButtonState();
+
 		// Update the preview widget
 		AdjustSceneForDecalPreview();
-		UpdatePreview();
+		RequestPreviewUpdate("Material property changed");
 		UpdateDocumentModified();
 
 		// Finally, if there is a change in the ShaderModel (rule processor) then reload the current material in the property editor
@@ -3744,25 +5255,219 @@ namespace SharedTools
 	/// </summary>
 	void MaterialLayeringDialog::OnRefreshPropertyEditor()
 	{
-		ui.treeViewPropEditor->BeginRefresh();
-		BuildPropertyEditor();
-		ui.treeViewPropEditor->EndRefresh();
+		RequestPropertyEditorRefresh(PropertyEditorRefresh::Rebuild, "Property editor refresh requested");
+	}
+
+	/// <summary>
+	/// Request a refresh of the property editor. Requests raised during the same event loop turn are collapsed into one refresh
+	/// using the most expensive mode requested, followed by the browser selection and asset checkpoint refresh.
+	/// </summary>
+	/// <param name="aRefresh"> How much of the property editor must be processed. </param>
+	/// <param name="apReason"> Static string describing what raised the request. </param>
+	void MaterialLayeringDialog::RequestPropertyEditorRefresh(PropertyEditorRefresh aRefresh, const char* apReason)
+	{
+		if (!PendingRefreshes.PropertyEditor || aRefresh > PendingRefreshes.PropertyEditorMode)
+		{
+			PendingRefreshes.PropertyEditorMode = aRefresh;
+		}
+		PendingRefreshes.PropertyEditor = true;
+		PendingRefreshes.AssetCheckpoint = true;
+
+		MarkMaterialEdited(EditedMaterialID);
+
+		ScheduleRefreshRequest(apReason);
+	}
+
+	/// <summary> Request an update of the preview widgets, collapsed with the other requests of the event loop turn. </summary>
+	/// <param name="apReason"> Static string describing what raised the request. </param>
+	void MaterialLayeringDialog::RequestPreviewUpdate(const char* apReason)
+	{
+		PendingRefreshes.Preview = true;
+
+		ScheduleRefreshRequest(apReason);
+	}
+
+	/// <summary> Request a refresh of the material browser, collapsed with the other requests of the event loop turn. </summary>
+	/// <param name="apReason"> Static string describing what raised the request. </param>
+	void MaterialLayeringDialog::RequestBrowserRefresh(const char* apReason)
+	{
+		PendingRefreshes.Browser = true;
+
+		ScheduleRefreshRequest(apReason);
+	}
+
+	/// <summary> Record a refresh request and make sure the pending requests execute on the next event loop turn. </summary>
+	/// <param name="apReason"> Static string describing what raised the request. </param>
+	void MaterialLayeringDialog::ScheduleRefreshRequest(const char* apReason)
+	{
+		++RefreshCounters.Requests;
+		PendingRefreshes.Reasons.push_back(apReason);
+
+		if (!PendingRefreshes.Scheduled && !PendingRefreshes.Suspended)
+		{
+			PendingRefreshes.Scheduled = true;
+			QMetaObject::invokeMethod(this, [this]() { ExecuteRefreshRequests(); }, Qt::QueuedConnection);
+		}
+	}
+
+	/// <summary>
+	/// Execute the refresh requests collapsed during the last event loop turn: property editor, then preview, then material browser.
+	/// Requests raised by a step are handled by the following steps of the same execution when possible.
+	/// </summary>
+	void MaterialLayeringDialog::ExecuteRefreshRequests()
+	{
+		if (PendingRefreshes.Suspended)
+		{
+			// Scheduled before the suspension, the requests stay pending until the next one once resumed.
+			PendingRefreshes.Scheduled = false;
+		}
+		else
+		{
+			++RefreshCounters.Executions;
+
+			if (PendingRefreshes.PropertyEditor)
+			{
+				const PropertyEditorRefresh refresh = PendingRefreshes.PropertyEditorMode;
+				PendingRefreshes.PropertyEditor = false;
+				PendingRefreshes.PropertyEditorMode = PropertyEditorRefresh::Incremental;
+
+				RefreshPropertyEditor(refresh);
+
+				// If we specified a post drop material to focus on (the dropped material), focus it, else focus current document on save/refresh.
+				const BSMaterial::LayeredMaterialID invalidMaterialIDC(BSMaterial::NullIDC);
+				ui.pMaterialBrowserWidget->SelectMaterial(FocusedMaterialID == invalidMaterialIDC ? EditedMaterialID : FocusedMaterialID);
+				// Clear focus drop target state for next refresh.
+				FocusedMaterialID = invalidMaterialIDC;
+			}
+
+			if (PendingRefreshes.Preview)
+			{
+				PendingRefreshes.Preview = false;
+				++RefreshCounters.PreviewUpdates;
+				UpdatePreview();
+			}
 
-		// If we specified a post drop material to focus on (the dropped material), focus it, else focus current document on save/refresh.
-		const BSMaterial::LayeredMaterialID invalidMaterialIDC(BSMaterial::NullIDC);
-		BSMaterial::LayeredMaterialID browserMaterialToFocus = EditedMaterialID;
-		ui.pMaterialBrowserWidget->SelectMaterial(FocusedMaterialID == invalidMaterialIDC ? EditedMaterialID : FocusedMaterialID);
-		// Clear focus drop target state for next refresh.
-		FocusedMaterialID = invalidMaterialIDC;
+			if (PendingRefreshes.AssetCheckpoint)
+			{
+				// Refresh Asset and Tags Checkpoint in memory, the browser is refreshed once it completes.
+				const bool refreshBrowser = PendingRefreshes.Browser;
+				PendingRefreshes.AssetCheckpoint = false;
+				PendingRefreshes.Browser = false;
 
-		// Refresh Asset and Tags Checkpoint in memory
-		CreationKit::Services::AssetMetaDB::RefreshCheckpoint([this](bool aSuccess) {
-			if (aSuccess)
+				CreationKit::Services::AssetMetaDB::RefreshCheckpoint([this, refreshBrowser](bool aSuccess) {
+					if (aSuccess || refreshBrowser)
+					{
+						SharedTools::CursorScope cursor(Qt::WaitCursor);
+						++RefreshCounters.BrowserRefreshes;
+						ui.pMaterialBrowserWidget->Refresh();
+					}
+				});
+			}
+			else if (PendingRefreshes.Browser)
 			{
-				SharedTools::CursorScope cursor(Qt::WaitCursor);
+				PendingRefreshes.Browser = false;
+				++RefreshCounters.BrowserRefreshes;
 				ui.pMaterialBrowserWidget->Refresh();
 			}
-		});
+
+			RefreshCounters.LastReasons = std::move(PendingRefreshes.Reasons);
+			PendingRefreshes.Reasons.clear();
+			PendingRefreshes.Scheduled = false;
+
+			// Requests raised after their step was executed run on the next turn.
+			if (PendingRefreshes.PropertyEditor || PendingRefreshes.Preview || PendingRefreshes.Browser || PendingRefreshes.AssetCheckpoint)
+			{
+				PendingRefreshes.Scheduled = true;
+				QMetaObject::invokeMethod(this, [this]() { ExecuteRefreshRequests(); }, Qt::QueuedConnection);
+			}
+		}
+	}
+
+	/// <summary>
+	/// Refresh the property editor. Incremental refreshes patch the built tree in place so expansion, persistent widgets and
+	/// scroll position are untouched, and fall back to a rebuild when the objects shaping the tree changed.
+	/// </summary>
+	/// <param name="aRefresh"> How much of the property editor must be processed. </param>
+	void MaterialLayeringDialog::RefreshPropertyEditor(PropertyEditorRefresh aRefresh)
+	{
+		if (aRefresh == PropertyEditorRefresh::Rebuild || !PatchPropertyEditor(aRefresh))
+		{
+			const int32_t scrollPosition = ui.treeViewPropEditor->verticalScrollBar()->value();
+
+			ui.treeViewPropEditor->BeginRefresh();
+			BuildPropertyEditor();
+			ui.treeViewPropEditor->EndRefresh();
+
+			ui.treeViewPropEditor->verticalScrollBar()->setValue(scrollPosition);
+			++RefreshCounters.PropertyEditorRebuilds;
+		}
+		else
+		{
+			++RefreshCounters.PropertyEditorPatches;
+		}
+	}
+
+	/// <summary>
+	/// Patch the built property tree in place, processing only the layer nodes whose hide state changed and, if requested,
+	/// the bindable property icons.
+	/// </summary>
+	/// <param name="aRefresh"> How much of the property editor must be processed. </param>
+	/// <returns> False if the objects shaping the tree changed and it must be rebuilt. </returns>
+	bool MaterialLayeringDialog::PatchPropertyEditor(PropertyEditorRefresh aRefresh)
+	{
+		bool patched = false;
+
+		BSMaterial::Flush();
+
+		QtPropertyEditor::ModelNode* ptreeNode = ui.treeViewPropEditor->QTreeNode();
+		if (ptreeNode && EditedSubMaterial.QValid() && CalculatePropertyTreeSignature() == BuiltTreeSignature)
+		{
+			// Resolve the patched nodes in the current tree, a node the editor rebuilt by itself was post processed anew.
+			stl::unordered_map<BSFixedString, QtPropertyEditor::ModelNode*> nodes;
+			ptreeNode->ApplyRecursively([&nodes](QtPropertyEditor::ModelNode& arNode)
+			{
+				if (arNode.QModel())
+				{
+					nodes.emplace(BSFixedString(arNode.QDataPath().QString()), &arNode);
+				}
+			});
+			auto findNode = [&nodes](const BSFixedString& aDataPath)
+			{
+				auto iter = nodes.find(aDataPath);
+				return iter != nodes.end() ? iter->second : nullptr;
+			};
+
+			for (PropertyTreeLayerNode& rlayerNode : LayerNodes)
+			{
+				const bool hidden = rlayerNode.Layer.QValid() && BSMaterial::GetHideSoloData(rlayerNode.Layer).Hide;
+				QtPropertyEditor::ModelNode* pnode = findNode(rlayerNode.DataPath);
+				if (hidden != rlayerNode.Hidden && pnode != nullptr)
+				{
+					rlayerNode.Hidden = hidden;
+					UICustomProcessLayerNode(*pnode, rlayerNode.Layer);
+				}
+			}
+
+			if (aRefresh == PropertyEditorRefresh::IncrementalBindings)
+			{
+				BoundProperties.Clear();
+				for (const BSFixedString& rdataPath : BindableNodePaths)
+				{
+					QtPropertyEditor::ModelNode* pnode = findNode(rdataPath);
+					if (pnode != nullptr)
+					{
+						UpdateBoundPropertyIcon(*pnode);
+					}
+				}
+			}
+
+			UpdateDocumentModified();
+			UpdateButtonState();
+			ui.treeViewPropEditor->viewport()->update();
+			patched = true;
+		}
+
+		return patched;
 	}
 
 	/// <summary> SLOT: On Refresh we update the the biome combobox in the Preview Widget </summary>
@@ -3790,9 +5495,10 @@ namespace SharedTools
 				result = Save();
 				break;
 			case QMessageBox::No:
-				// Reload the material and derived object
+				// Reload the material and derived object, the history of the discarded changes is lost.
+				pUndoRedoStack->clear();
 				BSMaterial::ReloadMaterial(EditedMaterialID);
-				OnRefreshPropertyEditor();
+				RequestPropertyEditorRefresh(PropertyEditorRefresh::Rebuild, "Material changes discarded");
 				break;
 			case QMessageBox::Cancel:
 				result = false;
@@ -3814,6 +5520,11 @@ namespace SharedTools
 			QTextStream windowTitleStream(&windowTitle);
 
 			EditedMaterialIsModified = BSMaterial::Internal::QDBStorage().IsFileModified(EditedMaterialID);
+			// The journaled edits were saved or discarded.
+			if (!EditedMaterialIsModified && spEditJournal && !ReplayingJournal && JournaledMaterial == EditedMaterialID && !spEditJournal->QEmpty())
+			{
+				spEditJournal->Clear();
+			}
 			// Always refresh Dialog title bar ( Material and Shader Model )
 			BSFixedString name;
 			BSMaterial::GetName(EditedMaterialID, name);
@@ -3911,19 +5622,19 @@ namespace SharedTools
 
 			if (!shaderModelName.QEmpty())
 			{
-				// Compare the Material shader model with the one we have currently loaded as processor.
-				// If we do not find the rule processor as being the same, it means it has changed and thus need to cause a
+				// Compare the Material shader model with the one we have currently applied.
+				// If it is not the same or its template was reloaded since, it has changed and thus need to cause a
 				// UI property refresh.
-				std::shared_ptr<RuleProcessor> processorToApply = SharedTools::GetShaderModelRuleProcessor(shaderModelName);
-				if (processorToApply)
+				if (SharedTools::IsShaderModel(shaderModelName))
 				{
-					shouldReload = std::find(processors.begin(), processors.end(), processorToApply) == processors.end();
+					shouldReload = shaderModelName != AppliedShaderModel || AppliedShaderModelRevision != SharedTools::QShaderModelTemplateRevision();
 				}
 			}
 			else if (processors.size() > 0)
 			{
 				// In the event that the user has set it back to "None" (empty smComponent filename), make sure no Shader Model is applied.
 				processors.clear();
+				AppliedShaderModel = BSFixedString();
 				shouldReload = true;
 			}
 		}
@@ -3931,14 +5642,24 @@ namespace SharedTools
 		if (shouldReload)
 		{
 			// Processor is outdated and needs to be updated.
-			OnRefreshPropertyEditor();
+			RequestPropertyEditorRefresh(PropertyEditorRefresh::Rebuild, "Shader model changed");
 		}
 	}
 
-	/// <summary> Calculate available(visible) Material properties after Shader Model has processed the hierarchy. </summary>
+	/// <summary> Calculate available(visible) Material properties for the Shader Model applied to the property editor. </summary>
 	void MaterialLayeringDialog::UpdateMaterialShaderModelState()
 	{
-		SharedTools::CalculateShaderModelState(*ui.treeViewPropEditor->QTreeNode(), MaterialSMState);
+		// A resumed editing session still holds a valid state.
+		if (OpenedSMStateValid && EditedSubMaterial == EditedMaterialID)
+		{
+			MaterialSMState = OpenedSMState;
+			OpenedSMStateValid = false;
+		}
+		// Counted from the material slots and compiled rules, only rules interpreted by a RuleProcessor need the processed hierarchy.
+		else if (!SharedTools::CalculateShaderModelState(EditedSubMaterial, AppliedShaderModel, MaterialSMState))
+		{
+			SharedTools::CalculateShaderModelState(*ui.treeViewPropEditor->QTreeNode(), MaterialSMState);
+		}
 	}
 
 	/// <summary>
@@ -3966,36 +5687,63 @@ namespace SharedTools
 		QtPropertyEditor::ModelNode* pchangedNode = ui.treeViewPropEditor->GetNode(aIndex);
 		BSASSERT(pchangedNode != nullptr, "ui.treeViewPropEditor->GetNode() returned nullptr");
 
-		QtPropertyEditor::ModelNode* pparent = pchangedNode->QParent();
-		while (pparent != nullptr)
+		const BSMaterial::LayerID layerID = spNodeContexts->Find(*pchangedNode).Layer;
+		if (layerID.QValid())
 		{
-			if (pparent->QModel())
+			const BSMaterial::HideSoloData hsData = BSMaterial::GetHideSoloData(layerID);
+			
+			if (hsData.Hide)
 			{
-				BSMaterial::LayerID layerID;
-				if (pparent->GetNativeValue(BSReflection::Ptr(&layerID)))
-				{
-					if (layerID.QValid())
-					{
-						const BSMaterial::HideSoloData hsData = BSMaterial::GetHideSoloData(layerID);
-						
-						if (hsData.Hide)
-						{
-							QMessageBox::warning(this, pDialogTitleC, "You are editing a layer that is hidden");
-							break;
-						}
-					}
-				}
+				QMessageBox::warning(this, pDialogTitleC, "You are editing a layer that is hidden");
 			}
-
-			pparent = pparent->QParent();
 		}
 
 
-		QtPropertyEditor::UndoCommand* pcommand = new QtPropertyEditor::UndoCommand(pchangedNode->QModel(), pchangedNode->QDataPath(), aPreviousValue, aNewValue, ui.treeViewPropEditor);
-		if (pcommand != nullptr)
+		// Continuous edits of the property merge into the previous command, leaving one undo step per gesture.
+		auto factory = [pmodel = pchangedNode->QModel(), dataPath = pchangedNode->QDataPath(), this](const QVariant& aPrevious, const QVariant& aNew)
+		{
+			return new QtPropertyEditor::UndoCommand(pmodel, dataPath, aPrevious, aNew, ui.treeViewPropEditor);
+		};
+		// Undoing the change only patches the tree, it is rebuilt if the property shaped it, such as a layer slot.
+		auto applied = [this](const QString& aDataPath, const QVariant& aValue)
+		{
+			JournalPropertyEdit(aDataPath, aValue);
+			RequestMaterialChangeNotification();
+			RequestPropertyEditorRefresh(PropertyEditorRefresh::Incremental, "Property edit undone or redone");
+		};
+		const QString dataPath(pchangedNode->QDataPath().QString());
+		// The command may be merged into the previous one and deleted by the push.
+		pUndoRedoStack->push(new PropertyEditUndoCommand(dataPath, aPreviousValue, aNewValue, std::move(factory), std::move(applied)));
+
+		JournalPropertyEdit(dataPath, aNewValue);
+		EnforceUndoMemoryBudget(*pUndoRedoStack);
+	}
+
+	/// <summary>
+	/// Notify a change of the edited material right away, then at most once per PropertyChangeNotifyIntervalC while the
+	/// changes keep coming, so a dragged slider or a burst of undo steps does not flush on each step.
+	/// </summary>
+	void MaterialLayeringDialog::RequestMaterialChangeNotification()
+	{
+		if (PropertyChangeTimer.isActive())
+		{
+			PropertyChangePending = true;
+		}
+		else
+		{
+			OnMaterialPropertyChanged();
+			PropertyChangeTimer.start(PropertyChangeNotifyIntervalC);
+		}
+	}
+
+	/// <summary> SLOT: Notify the property editor changes received since the last notification, if any. </summary>
+	void MaterialLayeringDialog::OnPropertyChangeTimer()
+	{
+		if (PropertyChangePending)
 		{
-			QtPropertyEditor::UndoSignalBlocker block(pcommand);
-			pUndoRedoStack->push(pcommand);
+			PropertyChangePending = false;
+			OnMaterialPropertyChanged();
+			PropertyChangeTimer.start(PropertyChangeNotifyIntervalC);
 		}
 	}
 
@@ -4031,11 +5779,15 @@ namespace SharedTools
 	/// <param name="aPath">Path of the shader model template that has changed.</param>
 	void MaterialLayeringDialog::OnShaderModelFileChanged(const QString& /*aPath*/)
 	{
+		// The Shader Model templates were reloaded, recompile their metadata on next query.
+		SharedTools::InvalidateShaderModelInfoTable();
+
 		// Clear assigned shared ptr processors.
 		ui.treeViewPropEditor->QProcessors().clear();
+		AppliedShaderModel = BSFixedString();
 
 		// Force a refresh of the property editor with current Material & Shader Model edited if any.
-		OnRefreshPropertyEditor();
+		RequestPropertyEditorRefresh(PropertyEditorRefresh::Rebuild, "Shader model file changed");
 	}
 
 	/// <summary> SLOT: Called when the user triggers an Undo command </summary>
@@ -4059,42 +5811,116 @@ namespace SharedTools
 	/// <summary>Creates a new undo command </summary>
 	/// <param name="aUndoAction">The undo action</param>
 	/// <param name="aRedoAction">The redo action</param>
-	/// <param name="apData">The undoredo data context</param>
+	/// <param name="aspData">The undoredo data context, owned by the command</param>
 	/// <returns> A pointer to a new undo command </returns>
-	QUndoCommand* MaterialLayeringDialog::MakeNewUndoCommand(MaterialLayeringDialog::UndoCallback&& aUndoAction, MaterialLayeringDialog::UndoCallback&& aRedoAction, void* apData)
+	QUndoCommand* MaterialLayeringDialog::MakeNewUndoCommand(MaterialLayeringDialog::UndoCallback&& aUndoAction, MaterialLayeringDialog::UndoCallback&& aRedoAction, std::unique_ptr<UndoPayload> aspData)
 	{
-		QUndoCommand* pcommand = new MaterialLayeringUndoCommand(std::move(aUndoAction), std::move(aRedoAction), apData);
+		QUndoCommand* pcommand = new MaterialLayeringUndoCommand(std::move(aUndoAction), std::move(aRedoAction), std::move(aspData));
 		pUndoRedoStack->push(pcommand);
+		EnforceUndoMemoryBudget(*pUndoRedoStack);
 		return pcommand;
 	}
 
+	/// <summary> Trim the oldest commands of a history once its commands exceed the undo memory budget. The commands that can be redone are kept. </summary>
+	/// <param name="arStack"> The history of a material. </param>
+	void MaterialLayeringDialog::EnforceUndoMemoryBudget(QUndoStack& arStack)
+	{
+		size_t payloadBytes = 0;
+		int32_t firstKept = 0;
+		for (int32_t i = arStack.count() - 1; i >= 0 && firstKept == 0; i--)
+		{
+			payloadBytes += static_cast<const MaterialLayeringHistoryCommand*>(arStack.command(i))->QPayloadSize();
+			if (payloadBytes > UndoMemoryBudget)
+			{
+				firstKept = std::min(i + 1, arStack.index());
+			}
+		}
+
+		if (firstKept > 0)
+		{
+			TrimUndoHistory(arStack, firstKept);
+		}
+	}
+
+	/// <summary> Set the undo memory kept per material, trimming the oldest commands of each history beyond. </summary>
+	/// <param name="aBytes"> The undo memory budget. </param>
+	void MaterialLayeringDialog::SetUndoMemoryBudget(size_t aBytes)
+	{
+		UndoMemoryBudget = aBytes;
+		EnforceUndoMemoryBudget(*pUndoRedoStack);
+		for (RecentMaterial& rsession : RecentMaterials)
+		{
+			EnforceUndoMemoryBudget(*rsession.pUndoStack);
+		}
+	}
+
+	/// <summary> Report the undo memory held by the history of the edited material and of the stashed editing sessions. </summary>
+	/// <returns> The undo memory of each material, the edited material first. </returns>
+	stl::vector<MaterialLayeringDialog::UndoMemoryUsage> MaterialLayeringDialog::QUndoMemoryUsage() const
+	{
+		auto measure = [](BSMaterial::LayeredMaterialID aMaterial, const QUndoStack& aStack)
+		{
+			UndoMemoryUsage usage;
+			usage.Material = aMaterial;
+			usage.Commands = static_cast<uint32_t>(aStack.count());
+			for (int32_t i = 0; i < aStack.count(); i++)
+			{
+				usage.PayloadBytes += static_cast<const MaterialLayeringHistoryCommand*>(aStack.command(i))->QPayloadSize();
+			}
+			return usage;
+		};
+
+		stl::vector<UndoMemoryUsage> usages;
+		usages.push_back(measure(EditedMaterialID, *pUndoRedoStack));
+		for (const RecentMaterial& rsession : RecentMaterials)
+		{
+			usages.push_back(measure(rsession.Material, *rsession.pUndoStack));
+		}
+		return usages;
+	}
+
 
 	/// <summary>Constructor for undo commands within the Material Layering dialog </summary> 
 	/// <param name="aUndoAction">The action to execute on undo </param>
 	/// <param name="aRedoAction">The action to execute on redo </param>
-	/// <param name="apData">A pointer to the undoredo context data. </param>
+	/// <param name="aspData">The undoredo context data, freed with the command. </param>
 	/// <param name="apParent"> The parent command </param>
 	MaterialLayeringUndoCommand::MaterialLayeringUndoCommand(
 		MaterialLayeringDialog::UndoCallback && aUndoAction,
 		MaterialLayeringDialog::UndoCallback && aRedoAction,
-		void* apData,
-		QUndoCommand* apParent) : QUndoCommand(apParent)
+		std::unique_ptr<MaterialLayeringDialog::UndoPayload> aspData,
+		QUndoCommand* apParent) : MaterialLayeringHistoryCommand(apParent)
 	{
 		UndoAction = MaterialLayeringDialog::UndoCallback(std::move(aUndoAction));
 		RedoAction = MaterialLayeringDialog::UndoCallback(std::move(aRedoAction));
-		pData = apData;
+		spData = std::move(aspData);
 	}
 
 	/// <summary>Executes the undo action if possible </summary> 
 	void MaterialLayeringUndoCommand::undo()
 	{
-		UndoAction(pData);
+		if (!Restacking)
+		{
+			UndoAction(spData.get());
+		}
 	}
 
 	/// <summary>Executes the redo action if possible </summary> 
 	void MaterialLayeringUndoCommand::redo()
 	{
-		RedoAction(pData);
+		if (!Restacking)
+		{
+			RedoAction(spData.get());
+		}
+	}
+
+	/// <summary>Move the actions and context data into a new command, to push it again on a trimmed history </summary>
+	/// <returns> The new command, this one is left empty </returns>
+	MaterialLayeringHistoryCommand* MaterialLayeringUndoCommand::Detach()
+	{
+		MaterialLayeringUndoCommand* pcommand = new MaterialLayeringUndoCommand(std::move(UndoAction), std::move(RedoAction), std::move(spData));
+		pcommand->setText(text());
+		return pcommand;
 	}
 
 } // MaterialLayering namespace
@@ -32,6 +32,7 @@
 #include <SharedTools/Qt/QtSharedIncludesBegin.h>
 #include "ui_MaterialLayeringDialog.h"
 #include <QtCore/QFutureWatcher>
+#include <QtCore/QSet>
 #include <QtCore/QTimer>
 #include <QtWidgets/QShortcut>
 #include <QtWidgets/QDialog>
@@ -63,8 +64,35 @@ namespace SharedTools
 
 	public:
 
-		/// <summary> the signature for an undo redo callback </summary>
-		using UndoCallback = stl::unique_function<void(void*)>;
+		/// <summary> Undo data owned by a MaterialLayeringUndoCommand, freed with the command. </summary>
+		struct UndoPayload
+		{
+			virtual ~UndoPayload() = default;
+			virtual size_t QMemorySize() const = 0;
+		};
+
+		/// <summary> the signature for an undo redo callback, receiving the payload of the command </summary>
+		using UndoCallback = stl::unique_function<void(UndoPayload*)>;
+
+		/// <summary> Undo memory held by the history of a material. </summary>
+		struct UndoMemoryUsage
+		{
+			BSMaterial::LayeredMaterialID Material;
+			size_t PayloadBytes = 0;
+			uint32_t Commands = 0;
+		};
+
+		/// <summary> Counters of the refresh scheduler, comparing the refreshes requested with the work executed. </summary>
+		struct RefreshStatistics
+		{
+			uint32_t Requests = 0;					// Refresh, preview and browser requests raised.
+			uint32_t Executions = 0;				// Event loop turns that executed pending requests.
+			uint32_t PropertyEditorRebuilds = 0;
+			uint32_t PropertyEditorPatches = 0;
+			uint32_t PreviewUpdates = 0;
+			uint32_t BrowserRefreshes = 0;
+			stl::vector<const char*> LastReasons;	// Reasons of the requests collapsed into the last execution.
+		};
 
 		MaterialLayeringDialog(QWidget *apParent, BSService::Site& arSite);
 		~MaterialLayeringDialog();
@@ -74,6 +102,9 @@ namespace SharedTools
 		void Close();
 
 		static HWND QWindowHandle() { return hwndDialog; }
+		const RefreshStatistics& QRefreshStatistics() const { return RefreshCounters; }
+		stl::vector<UndoMemoryUsage> QUndoMemoryUsage() const;
+		void SetUndoMemoryBudget(size_t aBytes);
 
 		void OpenAsset(const char* apFileName) override;
 		void SetMaterialPickerActive( bool aActive );
@@ -106,6 +137,7 @@ namespace SharedTools
 		void ToggleExperimentalModeShaders();
 		void OnReparentMaterial(BSMaterial::LayeredMaterialID aParentMaterial);
 		void OnMaterialPropertyChanged();
+		void OnPropertyChangeTimer();
 		void OnPreviewFileChanged(const QString& arFilePath);
 		void OnRefreshPropertyEditor();
 		void OnRefreshPreviewBiomes();
@@ -131,8 +163,84 @@ namespace SharedTools
 
 		void OnMaterialPropertyControllerRefreshed(BSBind::ControllerPtr aspController, BSBind::NodePtr apNode);
 		void OnLODChanged(int32_t aIndex);
+		void OnPropertyNodeExpanded(const QModelIndex& aIndex);
+		void OnLayerHideClicked(bool aPressed);
+		void OnLayerSoloClicked(QWidget* apSender, bool aPressed);
 
 	private:
+		/// <summary> How much of the property editor a refresh must process, ordered by cost. </summary>
+		enum class PropertyEditorRefresh
+		{
+			Incremental,			// Patch the built tree in place, rebuilding only if the objects shaping it changed.
+			IncrementalBindings,	// Same as Incremental, also re-evaluating the bound property icons.
+			Rebuild,				// Tear down and rebuild the whole property tree.
+		};
+
+		/// <summary> Refresh requests raised during the current event loop turn, executed once by ExecuteRefreshRequests. </summary>
+		struct PendingRefresh
+		{
+			bool Scheduled = false;
+			bool Suspended = false;			// Requests are only recorded, while Save All runs the event loop to report its progress.
+			bool PropertyEditor = false;
+			PropertyEditorRefresh PropertyEditorMode = PropertyEditorRefresh::Incremental;	// Most expensive mode requested.
+			bool Preview = false;
+			bool Browser = false;
+			bool AssetCheckpoint = false;
+			stl::vector<const char*> Reasons;
+		};
+
+		/// <summary> Objects shaping the property tree. While they are unchanged, the built tree can be patched in place. </summary>
+		struct PropertyTreeSignature
+		{
+			BSMaterial::LayeredMaterialID Material;
+			BSFixedString ShaderModel;
+			uint32_t ShaderModelRevision = 0;
+			SharedTools::ShaderModelState State;
+			stl::vector<BSMaterial::LayerID> Layers;
+			stl::vector<BSMaterial::BlenderID> Blenders;
+			stl::vector<BSMaterial::UVStreamID> UVStreams;
+
+			bool operator==(const PropertyTreeSignature& aOther) const;
+			bool operator!=(const PropertyTreeSignature& aOther) const { return !(*this == aOther); }
+		};
+
+		/// <summary> Bound state of the material bindings shown in the property tree, memoized for one build of the tree. </summary>
+		struct BindingIndex
+		{
+			stl::unordered_map<BSFixedString, BSMaterial::LayeredMaterialID> Materials;	// Material resolved from each file of the node models.
+			stl::unordered_map<uint64_t, bool> Bound;									// Keyed by material, binding kind, binding and layer index.
+
+			BSMaterial::LayeredMaterialID FindMaterial(QtPropertyEditor::ModelNode& arNode);
+			template<typename BindingT, typename FindFunctorT>
+			bool IsBound(BSMaterial::LayeredMaterialID aMaterial, bool aUVBinding, BindingT aBinding, uint16_t aLayerIdx, FindFunctorT&& arFind);
+			void Clear();
+		};
+
+		struct PropertyNodeContextTable;
+		class EditJournal;
+
+		/// <summary> Editing session of a recently edited material, resumed when the material is opened again. </summary>
+		struct RecentMaterial
+		{
+			BSMaterial::LayeredMaterialID Material;
+			QUndoStack* pUndoStack = nullptr;
+			stl::vector<QString> ExpandedProperties;		// Display name path of each expanded property.
+			int32_t ScrollPosition = 0;
+			SharedTools::ShaderModelState State;
+			bool StateValid = false;						// False if State belongs to a LOD material.
+			uint32_t ShaderModelRevision = 0;				// Shader Model template revision State was computed with.
+			uint32_t EditSerial = 0;						// Last material edit when the session was stashed.
+			stl::vector<BSMaterial::ID> DataParents;		// Materials State depends on, besides Material.
+		};
+
+		/// <summary> Layer node of the built property tree, with the hide state it was processed with. </summary>
+		struct PropertyTreeLayerNode
+		{
+			BSMaterial::LayerID Layer;
+			BSFixedString DataPath;		// The node is looked up again on each patch, the editor may have rebuilt it.
+			bool Hidden = false;
+		};
+
 		void InitializeSignalsAndSlots();
 		void InitializeEditingComponents();
 		void InitializePreviewWidget();
@@ -140,8 +248,26 @@ namespace SharedTools
 		bool ReparentMaterial(QWidget* apParent, BSMaterial::LayeredMaterialID aTargetMaterial, BSMaterial::LayeredMaterialID aParentMaterial, bool aUserConfirmationPrompt =true);
 		void AdjustSceneForDecalPreview(bool aForceOperation = false);
 		void InitializeMaterialLayerButtonsCallbacks(QtPropertyEditor::ModelNode& arModelNode);
+		void NavigateToLayer(uint32_t aNumkey);
 		void BuildPropertyEditor();
-		void PropagateShaderModelState();
+		void AttachOpenedMaterial();
+		void SwitchEditingSession(BSMaterial::LayeredMaterialID aNextMaterial);
+		bool IsSessionStateValid(const RecentMaterial& aSession) const;
+		void MarkMaterialEdited(BSMaterial::LayeredMaterialID aMaterial);
+		void OnMaterialObjectChanged(BSComponentDB2::ID aObject);
+		void CollectExpandedProperties(const QModelIndex& aParent, const QString& aParentPath, stl::vector<QString>& arPaths);
+		void ExpandProperties(const QModelIndex& aParent, const QString& aParentPath, const QSet<QString>& aPaths);
+		void ProcessPropertyTree();
+		void ProcessPropertyNodes(QtPropertyEditor::ModelNode& arParentNode, bool aProcessParent);
+		void RefreshPropertyEditor(PropertyEditorRefresh aRefresh);
+		void RequestPropertyEditorRefresh(PropertyEditorRefresh aRefresh, const char* apReason);
+		void RequestPreviewUpdate(const char* apReason);
+		void RequestMaterialChangeNotification();
+		void RequestBrowserRefresh(const char* apReason);
+		void ScheduleRefreshRequest(const char* apReason);
+		void ExecuteRefreshRequests();
+		bool PatchPropertyEditor(PropertyEditorRefresh aRefresh);
+		PropertyTreeSignature CalculatePropertyTreeSignature() const;
 		void ApplyShaderModel(const char* apShaderModel);
 		BSTArray<BSFixedString> CheckoutCurrentFiles(bool aVerbose, bool* apOutAllCheckedOut = nullptr);
 		bool PromptToSaveChanges();
@@ -150,10 +276,14 @@ namespace SharedTools
 		void UpdateShaderModel();
 		void UpdateMaterialShaderModelState();
 		bool EditedFileExists() const;
-		void RestoreMaterialBackup(void* apData);
-		void RemoveLastLayer(void*);
-		Json::Value* CreateMaterialBackup();
-		QUndoCommand* MakeNewUndoCommand(UndoCallback&& aUndoAction, UndoCallback&& aRedoAction, void* apData);
+		void RestoreLayer(UndoPayload* apData);
+		void RemoveLayer(UndoPayload* apData);
+		void OpenEditJournal();
+		void CloseEditJournal();
+		void ReplayEditJournal();
+		void JournalPropertyEdit(const QString& aDataPath, const QVariant& aValue);
+		QUndoCommand* MakeNewUndoCommand(UndoCallback&& aUndoAction, UndoCallback&& aRedoAction, std::unique_ptr<UndoPayload> aspData);
+		void EnforceUndoMemoryBudget(QUndoStack& arStack);
 
 		void Delete(const BSFixedString& aFile);
 		void Move(const BSFixedString& aOldFilename, const BSFixedString& aNewFilename);
@@ -172,9 +302,10 @@ namespace SharedTools
 		bool CanRemoveLayer() const;
 
 		void IsolateFirstLayer();
-		void UICustomProcessLayerNode(QtPropertyEditor::ModelNode& arNode);
+		void UICustomProcessLayerNode(QtPropertyEditor::ModelNode& arNode, BSMaterial::LayerID aLayerID);
 		void UpdateLODCombo();
 		void BuildIconsForBoundProperties(QtPropertyEditor::QtGenericPropertyEditor* apEditor, QtPropertyEditor::ModelNode& arNode);
+		void UpdateBoundPropertyIcon(QtPropertyEditor::ModelNode& arNode);
 
 		// from QDialog
 		void closeEvent(QCloseEvent* apEvent) override;
@@ -184,18 +315,28 @@ namespace SharedTools
 
 		static HWND	hwndDialog;							// Our window handle
 		static constexpr int32_t EditLODsDataC = -1;
+		static constexpr uint32_t LayerShortcutCountC = 10;	// ALT+0 to ALT+9
+		static constexpr uint32_t RecentMaterialCountC = 8;	// Editing sessions kept for recently edited materials.
+		static constexpr size_t DefaultUndoMemoryBudgetC = 64 * 1024 * 1024;	// Undo payload bytes kept per material.
 
 		// Qt UI
 		Ui::MaterialLayeringDialog ui;
 		std::map<std::string, uint32_t> LayerNameToNumkeyMap;
+		int32_t LayerShortcutRows[LayerShortcutCountC];		// Row of the layer each ALT+Numkey shortcut navigates to, -1 if none.
 		MaterialModelProxy* pMaterialModel = nullptr;
 		QMenu *pPropertyContextMenu = nullptr;
 		QTimer RefreshTimer;
+		QTimer PropertyChangeTimer;						// Caps the rate of property change notifications during a gesture.
+		bool PropertyChangePending = false;				// A property change is waiting for PropertyChangeTimer to be notified.
 		QDialog* pFormPreviewDialog = nullptr;
 		PreviewWidget* pFormPreviewWidget = nullptr;
 		MaterialLayeringBakeOptionsDialog* pBakeOptionsDialog = nullptr;
 
 		BSService::Site& rSite;							// Site we're registered to
+		std::unique_ptr<PropertyNodeContextTable> spNodeContexts;	// Context each property node inherits from its ancestors.
+		std::unique_ptr<EditJournal> spEditJournal;		// Unsaved edits of the edited material, kept on disk to recover them after a crash.
+		BSMaterial::LayeredMaterialID JournaledMaterial;	// Material whose edits spEditJournal records.
+		bool ReplayingJournal = false;					// Edits replayed from the journal are not journaled again.
 		QUndoStack*	pUndoRedoStack = nullptr;			// Stack of QUndoCommands
 		BSString PerforceSyncPath;						// Path to sync material files from in Perforce
 		QString SaveAsDir;								// The last folder the user saved to
@@ -203,7 +344,26 @@ namespace SharedTools
 		BSMaterial::LayeredMaterialID EditedSubMaterial;// Current LOD material that's being edited
 		BSMaterial::LayeredMaterialID FocusedMaterialID;// Next Material to focus in the Material browser on refresh, if a Drag&Drop occurred.
 		SharedTools::ShaderModelState MaterialSMState;	// Current Shader Model properties calculated dynamically.
-		bool UIProcessorsActive = true;					// Set if we should apply any UI Processors when loading model nodes.
+		SharedTools::ShaderModelState OpenedSMState;	// State of a resumed editing session, used by the next build.
+		bool OpenedSMStateValid = false;				// If true OpenedSMState replaces the state calculation of the next build.
+		stl::vector<RecentMaterial> RecentMaterials;	// Stashed editing sessions, least recently edited first.
+		stl::unordered_map<uint64_t, uint32_t> MaterialEditSerials;	// Last edit of each material edited in the dialog.
+		uint32_t EditSerial = 0;						// Incremented on each material edit.
+		uint32_t MaterialChangeListener = 0;			// Registration with the MaterialChangeNotifyService.
+		bool SavingMaterials = false;					// Set while the dialog saves materials, their notifications keep the stashed histories.
+		size_t UndoMemoryBudget = DefaultUndoMemoryBudgetC;	// Undo payload bytes kept per material, the oldest commands are trimmed beyond.
+		stl::vector<QString> PendingExpandedProperties;	// Properties to expand once the resumed material is attached.
+		int32_t PendingScrollPosition = 0;				// Scroll position to restore once the resumed material is attached.
+		BSFixedString AppliedShaderModel;				// Shader Model whose rules are applied to the property editor.
+		uint32_t AppliedShaderModelRevision = 0;		// Shader Model template revision when the rules were applied.
+		PropertyTreeSignature BuiltTreeSignature;		// Objects shaping the property tree when it was last built.
+		stl::vector<PropertyTreeLayerNode> LayerNodes;	// Layer nodes of the built property tree.
+		stl::vector<BSFixedString> BindableNodePaths;	// Data path of the bindable property nodes of the built property tree.
+		BindingIndex BoundProperties;					// Bound state of the bindings decorating the built property tree.
+		stl::scatter_table_set<BSFixedString> DeferredPropertyNodes;	// Data path of the nodes whose children are processed when expanded.
+		uint32_t RemainingLayersToBind = 0;			// Layers left to map to an ALT+Numkey shortcut.
+		PendingRefresh PendingRefreshes;				// Refresh requests waiting for the next event loop turn.
+		RefreshStatistics RefreshCounters;				// Requested versus executed refreshes.
 		bool EditedMaterialIsModified = false;			// If true there are unsaved changes
 		bool EnableControllerVisualization = true;		// Determine if we want to visualize the controllers on a material
 		bool SyncLatestOnOpening = true;				// Ask the user if they wish to sync to head
@@ -211,23 +371,45 @@ namespace SharedTools
 		bool PreviewingDecal = false;					// If the editor is currently previewing a decal.
 	};
 
+	/// <summary> Base of the commands pushed on the undo histories of the Material Layering dialog, accounted against the undo memory budget </summary>
+	class MaterialLayeringHistoryCommand : public QUndoCommand
+	{
+	public:
+		using QUndoCommand::QUndoCommand;
+
+		/// <summary> Get the memory held by the command to undo and redo its change. </summary>
+		virtual size_t QPayloadSize() const = 0;
+
+		/// <summary> Move the command into a new one, to push it again on a trimmed history. This command is left empty. </summary>
+		virtual MaterialLayeringHistoryCommand* Detach() = 0;
+
+		/// <summary> While restacked, undo and redo only move the command through its history without applying it, and nothing merges into it. </summary>
+		void SetRestacking(bool aRestacking) { Restacking = aRestacking; }
+
+	protected:
+		bool Restacking = false;
+	};
+
 	/// <summary> Custom undo/redo commands for the Material Layering dialog </summary>
-	class MaterialLayeringUndoCommand : public QUndoCommand
+	class MaterialLayeringUndoCommand : public MaterialLayeringHistoryCommand
 	{
 	public:
 		MaterialLayeringUndoCommand(
 			MaterialLayeringDialog::UndoCallback&& aUndoAction,
 			MaterialLayeringDialog::UndoCallback&& aRedoAction,
-			void* apContext,
+			std::unique_ptr<MaterialLayeringDialog::UndoPayload> aspContext,
 			QUndoCommand* apParent = nullptr);
 
 		void undo() override;
 		void redo() override;
 
+		size_t QPayloadSize() const override { return sizeof(MaterialLayeringUndoCommand) + (spData ? spData->QMemorySize() : 0); }
+		MaterialLayeringHistoryCommand* Detach() override;
+
 	private:
 		MaterialLayeringDialog::UndoCallback UndoAction;
 		MaterialLayeringDialog::UndoCallback RedoAction;
-		void* pData = nullptr;
+		std::unique_ptr<MaterialLayeringDialog::UndoPayload> spData;
 	};
 
 } // SharedTools namespace
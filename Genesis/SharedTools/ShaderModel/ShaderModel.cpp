@@ -21,6 +21,8 @@
 #include "ShaderModel.h"
 
 #include <SharedTools/Qt/QtSharedIncludesBegin.h>
+#include <QtCore/QCoreApplication>
+#include <QtCore/QThread>
 #include <QtWidgets/QFileDialog>
 #include <QtWidgets/QMessageBox>
 #include <QtWidgets/QWidget>
@@ -60,8 +62,557 @@ namespace
 	constexpr char ShaderModelMetaDisplayNameC[] = { "DisplayName" };
 	constexpr char ShaderModelMetaDisableLOD[] = { "DisableLOD" };
 
+	// Template rules json keys and values
+	constexpr char ShaderModelRulesClassC[] = { "Class" };
+	constexpr char ShaderModelRulesListC[] = { "Rules" };
+	constexpr char ShaderModelRuleFromC[] = { "From" };
+	constexpr char ShaderModelRuleOpC[] = { "Op" };
+	constexpr char ShaderModelRuleOpAddC[] = { "Add" };
+	constexpr char ShaderModelRuleOpRemoveC[] = { "Remove" };
+	constexpr char ShaderModelRuleWildcardC[] = { "*" };
+	constexpr char LayeredMaterialClassC[] = { "BSMaterial::LayeredMaterialID" };
+
 	// Set if Experimental materials are editable in the tool.
 	INISetting bExperimentalMaterials("bExperimentalMaterials:ShaderModels", true);
+
+	/// <summary> Rules of one template class, resolved to a visibility decision per property name. </summary>
+	struct CompiledClassRules
+	{
+		stl::unordered_map<BSFixedString, bool> Removed;	// Decision for the properties named by a rule declared after the last wildcard.
+		bool WildcardRemoved = false;						// Decision for every other property.
+
+		/// <summary> Classify a direct child property of a node of the rule class. </summary>
+		/// <param name="aPropertyName"> Interned name of the property. </param>
+		/// <returns> True if the rules remove the property. </returns>
+		bool IsRemoved(const BSFixedString& aPropertyName) const
+		{
+			auto iter = Removed.find(aPropertyName);
+			return iter != Removed.end() ? iter->second : WildcardRemoved;
+		}
+	};
+
+	/// <summary> Hide the direct children of a rule class node removed by the compiled rules. </summary>
+	/// <param name="aRules"> Compiled rules of the node class. </param>
+	/// <param name="arNode"> Node of the rule class. </param>
+	void ApplyCompiledClassRules(const CompiledClassRules& aRules, QtPropertyEditor::ModelNode& arNode)
+	{
+		if (arNode.QModel())
+		{
+			arNode.ForEach([&aRules](QtPropertyEditor::ModelNode& arChild)
+			{
+				if (aRules.IsRemoved(BSFixedString(arChild.QName())))
+				{
+					// Hidden nodes are deleted by the DeleteProcessor, like the ones hidden by the RuleProcessor.
+					arChild.SetState(QtPropertyEditor::ModelNode::Hidden);
+				}
+				return BSContainer::SkipChildren;
+			});
+		}
+	}
+
+	/// <summary> Create the processor applying compiled rules to the nodes of a reflected type. </summary>
+	/// <param name="aspRules"> Compiled rules shared with the processor. </param>
+	/// <returns> The processor. </returns>
+	template <typename ClassType>
+	std::shared_ptr<QtPropertyEditor::CustomUIProcessor> MakeCompiledClassProcessor(std::shared_ptr<const CompiledClassRules> aspRules)
+	{
+		return std::make_shared<QtPropertyEditor::CustomUIProcessor>(ClassType::ReflectedType,
+			[spRules = std::move(aspRules)](QtPropertyEditor::ModelNode& arNode) { ApplyCompiledClassRules(*spRules, arNode); });
+	}
+
+	/// <summary> Rule classes that can be compiled, any other class falls back to the RuleProcessor. </summary>
+	struct CompiledClassFactory
+	{
+		const char* pClassName;
+		std::shared_ptr<QtPropertyEditor::CustomUIProcessor> (*pMakeProcessor)(std::shared_ptr<const CompiledClassRules>);
+	};
+
+	const CompiledClassFactory CompiledClassFactoriesA[] =
+	{
+		{ LayeredMaterialClassC, &MakeCompiledClassProcessor<BSMaterial::LayeredMaterialID> },
+		{ "BSMaterial::LayerID", &MakeCompiledClassProcessor<BSMaterial::LayerID> },
+		{ "BSMaterial::BlenderID", &MakeCompiledClassProcessor<BSMaterial::BlenderID> },
+		{ "BSMaterial::UVStreamID", &MakeCompiledClassProcessor<BSMaterial::UVStreamID> },
+	};
+
+	/// <summary>
+	/// Compile the "Rules" array of one template class. Rules are applied in order, so the last rule matching a property wins.
+	/// Only whole property names and the "*" wildcard with Add/Remove operations are supported.
+	/// </summary>
+	/// <param name="aRules"> The class "Rules" json array. </param>
+	/// <param name="arCompiled"> OUT: Compiled rules. </param>
+	/// <returns> True if every rule could be compiled. </returns>
+	bool CompileClassRules(const nlohmann::json& aRules, CompiledClassRules& arCompiled)
+	{
+		bool success = aRules.is_array();
+
+		// Index and decision of the last rule for each property name.
+		stl::scrap_unordered_map<BSFixedString, std::pair<uint32_t, bool>> namedRules;
+		uint32_t wildcardIndex = 0;
+		bool hasWildcard = false;
+
+		for (uint32_t i = 0; success && i < aRules.size(); ++i)
+		{
+			const nlohmann::json& rrule = aRules[i];
+			success = rrule.is_object() && rrule.size() == 2 &&
+				rrule.contains(ShaderModelRuleFromC) && rrule[ShaderModelRuleFromC].is_string() &&
+				rrule.contains(ShaderModelRuleOpC) && rrule[ShaderModelRuleOpC].is_string();
+			if (success)
+			{
+				const std::string& from = rrule[ShaderModelRuleFromC].get_ref<const std::string&>();
+				const std::string& op = rrule[ShaderModelRuleOpC].get_ref<const std::string&>();
+				const bool isRemove = op == ShaderModelRuleOpRemoveC;
+				success = (isRemove || op == ShaderModelRuleOpAddC) && !from.empty();
+				if (success && from == ShaderModelRuleWildcardC)
+				{
+					hasWildcard = true;
+					wildcardIndex = i;
+					arCompiled.WildcardRemoved = isRemove;
+				}
+				else if (success)
+				{
+					// Partial globs and property paths are left to the RuleProcessor.
+					success = from.find_first_of("*?.[") == std::string::npos;
+					if (success)
+					{
+						namedRules[BSFixedString(from.c_str())] = { i, isRemove };
+					}
+				}
+			}
+		}
+
+		if (success)
+		{
+			// A wildcard declared after a named rule overrides it.
+			for (const auto& rentry : namedRules)
+			{
+				if (!hasWildcard || rentry.second.first > wildcardIndex)
+				{
+					arCompiled.Removed.emplace(rentry.first, rentry.second.second);
+				}
+			}
+		}
+		return success;
+	}
+
+	/// <summary> Compile the rules of a Shader Model template into one processor per rule class. </summary>
+	/// <param name="aTemplateRules"> The template rules json array. </param>
+	/// <param name="arProcessors"> OUT: Processors applying the compiled rules. </param>
+	/// <param name="arLayeredMaterialRules"> OUT: Compiled rules of the layered material class, null if the template has none. </param>
+	/// <returns> True if all the template rules could be compiled. </returns>
+	bool CompileTemplateRules(const nlohmann::json& aTemplateRules, SharedTools::ShaderModelProcessorList& arProcessors, std::shared_ptr<const CompiledClassRules>& arLayeredMaterialRules)
+	{
+		arProcessors.clear();
+		arLayeredMaterialRules.reset();
+		bool success = aTemplateRules.is_array();
+		stl::scrap_set<BSFixedString> compiledClasses;
+
+		for (auto iter = aTemplateRules.begin(); success && iter != aTemplateRules.end(); ++iter)
+		{
+			const nlohmann::json& rclassRules = *iter;
+			success = rclassRules.is_object() && rclassRules.contains(ShaderModelRulesClassC) && rclassRules[ShaderModelRulesClassC].is_string() &&
+				rclassRules.contains(ShaderModelRulesListC);
+
+			const CompiledClassFactory* pfactory = nullptr;
+			if (success)
+			{
+				const std::string& className = rclassRules[ShaderModelRulesClassC].get_ref<const std::string&>();
+				for (const CompiledClassFactory& rfactory : CompiledClassFactoriesA)
+				{
+					if (className == rfactory.pClassName)
+					{
+						pfactory = &rfactory;
+						break;
+					}
+				}
+
+				// Several entries for the same class would have to be merged in order, leave that to the RuleProcessor.
+				success = pfactory != nullptr && compiledClasses.insert(BSFixedString(pfactory->pClassName)).second;
+			}
+
+			if (success)
+			{
+				auto sprules = std::make_shared<CompiledClassRules>();
+				success = CompileClassRules(rclassRules[ShaderModelRulesListC], *sprules);
+				if (success)
+				{
+					if (BSstrcmp(pfactory->pClassName, LayeredMaterialClassC) == 0)
+					{
+						arLayeredMaterialRules = sprules;
+					}
+					arProcessors.emplace_back(pfactory->pMakeProcessor(std::move(sprules)));
+				}
+			}
+		}
+
+		if (!success)
+		{
+			arProcessors.clear();
+			arLayeredMaterialRules.reset();
+		}
+		return success;
+	}
+
+	/// <summary>
+	/// Compile the rules of a Shader Model template from the json held by the template manager, the same json its RuleProcessor
+	/// applies, so templates created or edited in memory compile to the rules the RuleProcessor would apply.
+	/// </summary>
+	/// <param name="arTemplateManager"> The loaded template manager. </param>
+	/// <param name="arInfo"> IN/OUT: Shader Model metadata to fill the compiled rules of. </param>
+	/// <param name="arLayeredMaterialRules"> OUT: Compiled rules of the layered material class, if any. </param>
+	void CompileShaderModelRules(QtPropertyEditor::TemplateManager& arTemplateManager, SharedTools::ShaderModelInfo& arInfo, std::shared_ptr<const CompiledClassRules>& arLayeredMaterialRules)
+	{
+		using namespace QtPropertyEditor;
+
+		const nlohmann::json* ptemplateJson = arTemplateManager.GetTemplate(ShaderModelsTemplateCategoryC, arInfo.Name.QString());
+		if (ptemplateJson != nullptr && ptemplateJson->is_object() && ptemplateJson->contains(TemplateManager::pJson_TemplateRulesC))
+		{
+			arInfo.RulesCompiled = CompileTemplateRules((*ptemplateJson)[TemplateManager::pJson_TemplateRulesC], arInfo.CompiledRules, arLayeredMaterialRules);
+		}
+	}
+
+	/// <summary> Shader Model metadata table keyed by the interned Shader Model name. </summary>
+	struct ShaderModelInfoTable
+	{
+		stl::unordered_map<BSFixedString, SharedTools::ShaderModelInfo> Infos;
+		stl::unordered_map<BSFixedString, BSFixedString> DisplayNameToName;	// Reverse index of ShaderModelInfo::DisplayName.
+		stl::unordered_map<BSFixedString, std::shared_ptr<const CompiledClassRules>> LayeredMaterialRules;	// Compiled layered material rules, by Shader Model name.
+		uint32_t Revision = 0;		// Incremented each time the templates are invalidated.
+		bool Built = false;
+	};
+
+	/// <summary>
+	/// Access the Shader Model metadata table singleton. The table is built, read and invalidated on the UI thread only,
+	/// it is not synchronized and references into it do not survive an invalidation.
+	/// </summary>
+	/// <returns> The table, not necessarily built yet. </returns>
+	ShaderModelInfoTable& QShaderModelInfoTable()
+	{
+		BSASSERT(QThread::currentThread() == QCoreApplication::instance()->thread(), "The Shader Model metadata table is only accessed from the UI thread");
+		static ShaderModelInfoTable table;
+		return table;
+	}
+
+	/// <summary> Read the metadata of every loaded Shader Model template once, instead of walking the template json on each query. </summary>
+	/// <param name="arTable"> OUT: Table to fill. </param>
+	void BuildShaderModelInfoTable(ShaderModelInfoTable& arTable)
+	{
+		using namespace QtPropertyEditor;
+
+		arTable.Infos.clear();
+		arTable.DisplayNameToName.clear();
+		arTable.LayeredMaterialRules.clear();
+
+		// Templates not loaded yet, keep the table dirty so the next query tries again.
+		TemplateManager& rtemplateManager = TemplateManager::QInstance();
+		if (rtemplateManager.QHasLoaded())
+		{
+			stl::vector<std::string> shaderModels;
+			rtemplateManager.GetTemplateList(ShaderModelsTemplateCategoryC, shaderModels);
+			arTable.Infos.reserve(shaderModels.size());
+			arTable.DisplayNameToName.reserve(shaderModels.size());
+
+			for (const std::string& rshaderModelName : shaderModels)
+			{
+				SharedTools::ShaderModelInfo info;
+				info.Name = BSFixedString(rshaderModelName.c_str());
+
+				const std::string rootMaterial = rtemplateManager.GetMetaDataValue<std::string>(ShaderModelsTemplateCategoryC, rshaderModelName.c_str(), ShaderModelMetaRootMaterialC);
+				info.RootMaterial = BSFixedString(rootMaterial.c_str());
+
+				// There are no display name alias, just re-use the name for the UI.
+				const std::string displayName = rtemplateManager.GetMetaDataValue<std::string>(ShaderModelsTemplateCategoryC, rshaderModelName.c_str(), ShaderModelMetaDisplayNameC);
+				info.DisplayName = displayName.empty() ? info.Name : BSFixedString(displayName.c_str());
+
+				info.Locked = rtemplateManager.GetMetaDataValue<bool>(ShaderModelsTemplateCategoryC, rshaderModelName.c_str(), ShaderModelMetaLockedC);
+				info.Switchable = rtemplateManager.GetMetaDataValue<bool>(ShaderModelsTemplateCategoryC, rshaderModelName.c_str(), ShaderModelMetaSwitchableC, true);
+				info.UsesLevelOfDetail = !rtemplateManager.GetMetaDataValue<bool>(ShaderModelsTemplateCategoryC, rshaderModelName.c_str(), ShaderModelMetaDisableLOD);
+				CompileShaderModelRules(rtemplateManager, info, arTable.LayeredMaterialRules[info.Name]);
+
+				// First template wins when two Shader Models share a display name, same as the former linear search.
+				arTable.DisplayNameToName.emplace(info.DisplayName, info.Name);
+				arTable.Infos.emplace(info.Name, std::move(info));
+			}
+
+			arTable.Built = true;
+		}
+	}
+
+	/// <summary> Get the Shader Model metadata table, building it if the templates changed since the last query. </summary>
+	/// <returns> The up to date table. </returns>
+	const ShaderModelInfoTable& QBuiltShaderModelInfoTable()
+	{
+		ShaderModelInfoTable& rtable = QShaderModelInfoTable();
+		if (!rtable.Built)
+		{
+			BuildShaderModelInfoTable(rtable);
+		}
+		return rtable;
+	}
+
+	/// <summary> Bit per entry of the data path table. </summary>
+	struct DataPathBits
+	{
+		stl::vector<uint64_t> Words;
+
+		void Set(uint32_t aIndex)
+		{
+			const uint32_t word = aIndex / 64;
+			if (word >= Words.size())
+			{
+				Words.resize(word + 1, 0);
+			}
+			Words[word] |= uint64_t(1) << (aIndex % 64);
+		}
+
+		bool Test(uint32_t aIndex) const
+		{
+			const uint32_t word = aIndex / 64;
+			return word < Words.size() && (Words[word] & (uint64_t(1) << (aIndex % 64))) != 0;
+		}
+	};
+
+	/// <summary> Get the data path stored by a node, rather than building a new path string from its parents like GetDataPath. </summary>
+	/// <param name="aNode"> Node to get the data path of. </param>
+	/// <returns> The data path, empty for the document root. </returns>
+	const char* QStoredDataPath(const QtPropertyEditor::ModelNode& aNode)
+	{
+		return aNode.QDataPath().QString();
+	}
+
+	/// <summary> Table assigning an index to every property data path found in a Shader Model root material. Only grows. </summary>
+	struct DataPathTable
+	{
+		static constexpr uint32_t InvalidIndexC = UINT32_MAX;
+
+		stl::unordered_map<BSFixedString, uint32_t> Indices;
+
+		uint32_t Add(const BSFixedString& aDataPath)
+		{
+			return Indices.emplace(aDataPath, static_cast<uint32_t>(Indices.size())).first->second;
+		}
+
+		uint32_t Find(const BSFixedString& aDataPath) const
+		{
+			auto iter = Indices.find(aDataPath);
+			return iter != Indices.end() ? iter->second : InvalidIndexC;
+		}
+	};
+
+	/// <summary> Properties left by a Shader Model on its root material, over the data path table. </summary>
+	struct ShaderModelPropertyMask
+	{
+		DataPathBits Visible;
+		DataPathBits ReadOnly;
+
+		/// <summary> Can a property keep its value when switching to this Shader Model ? </summary>
+		bool CanCarryOver(uint32_t aDataPathIndex) const
+		{
+			return aDataPathIndex != DataPathTable::InvalidIndexC && Visible.Test(aDataPathIndex) && !ReadOnly.Test(aDataPathIndex);
+		}
+	};
+
+	/// <summary> Property masks keyed by Shader Model root material ID, valid for one template revision. </summary>
+	struct ShaderModelPropertyMaskCache
+	{
+		DataPathTable DataPaths;
+		stl::unordered_map<uint32_t, ShaderModelPropertyMask> Masks;
+		uint32_t TemplateRevision = 0;
+	};
+
+	/// <summary> Access the Shader Model property mask cache singleton </summary>
+	/// <returns> The cache. </returns>
+	ShaderModelPropertyMaskCache& QShaderModelPropertyMaskCache()
+	{
+		static ShaderModelPropertyMaskCache cache;
+		return cache;
+	}
+
+	/// <summary>
+	/// Get the properties visible with a Shader Model root material, building its mask the first time.
+	/// The root material hierarchy is created and processed by the Shader Model rules only once per mask.
+	/// </summary>
+	/// <param name="aShaderModelRootMaterial"> Shader Model Root Material. </param>
+	/// <returns> The mask of the root material properties. </returns>
+	const ShaderModelPropertyMask& QShaderModelPropertyMask(BSMaterial::LayeredMaterialID aShaderModelRootMaterial)
+	{
+		using namespace QtPropertyEditor;
+
+		ShaderModelPropertyMaskCache& rcache = QShaderModelPropertyMaskCache();
+		const uint32_t templateRevision = SharedTools::QShaderModelTemplateRevision();
+		if (rcache.TemplateRevision != templateRevision)
+		{
+			rcache.Masks.clear();
+			rcache.TemplateRevision = templateRevision;
+		}
+
+		auto [iter, inserted] = rcache.Masks.try_emplace(aShaderModelRootMaterial.QID().QValue());
+		ShaderModelPropertyMask& rmask = iter->second;
+		if (inserted)
+		{
+			// Create Model Node hierarchy for the root material and apply its Shader Model, then delete the hidden nodes.
+			ModelNode rootNode;
+			GenericEditorBuilder visitor(rootNode);
+			visitor.Visit(BSReflection::ObjectPtr(&aShaderModelRootMaterial));
+			BSMaterial::ShaderModelComponent smComponent = BSMaterial::GetLayeredMaterialShaderModel(aShaderModelRootMaterial);
+			SharedTools::ApplyShaderModelRules(rootNode, smComponent.FileName);
+			DeleteProcessor cleanupProcessor;
+			cleanupProcessor.Process(rootNode);
+
+			rootNode.ApplyRecursively([&rcache, &rmask](ModelNode& arNode)
+			{
+				const char* pdataPath = QStoredDataPath(arNode);
+				if (pdataPath[0] != '\0')
+				{
+					const uint32_t index = rcache.DataPaths.Add(BSFixedString(pdataPath));
+					rmask.Visible.Set(index);
+					if (arNode.QState() == ModelNode::ReadOnly)
+					{
+						rmask.ReadOnly.Set(index);
+					}
+				}
+			});
+		}
+		return rmask;
+	}
+
+	/// <summary>
+	/// Visit the properties of a Material hierarchy that cannot carry over to a Shader Model root material.
+	/// Children of properties missing from the Shader Model are skipped, as they are reverted with their parent.
+	/// </summary>
+	/// <param name="arMaterialRootNode"> Material ModelNode root. </param>
+	/// <param name="aMask"> Properties of the Shader Model Root Material to compare against. </param>
+	/// <param name="aDataPaths"> Data path table the mask refers to. </param>
+	/// <param name="aFunctor"> Called with each property to revert. </param>
+	template <typename Functor>
+	void ForEachPropertyToRevert(QtPropertyEditor::ModelNode& arMaterialRootNode, const ShaderModelPropertyMask& aMask, const DataPathTable& aDataPaths, Functor&& aFunctor)
+	{
+		using namespace QtPropertyEditor;
+
+		arMaterialRootNode.ForEach([&aMask, &aDataPaths, &aFunctor](ModelNode& arChild)
+		{
+			BSContainer::ForEachResult result = BSContainer::Continue;
+
+			// Process all properties except root which is the LayeredMaterial ID document.
+			// The data path is interned and looked up in place, no path string is built per node.
+			const char* psrcPropertyDataPath = QStoredDataPath(arChild);
+			if (psrcPropertyDataPath[0] != '\0')
+			{
+				const uint32_t index = aDataPaths.Find(BSFixedString(psrcPropertyDataPath));
+				const bool foundInDestination = index != DataPathTable::InvalidIndexC && aMask.Visible.Test(index);
+				if (!foundInDestination)
+				{
+					// Skip children if node is not found.
+					result = BSContainer::SkipChildren;
+				}
+
+				if (!aMask.CanCarryOver(index))
+				{
+					aFunctor(arChild);
+				}
+			}
+			return result;
+		});
+	}
+
+	/// <summary> Revert a property that cannot carry over to a new Shader Model to its data parent value, or its default value. </summary>
+	/// <param name="arNode"> Property to revert. </param>
+	void RevertMigratedProperty(QtPropertyEditor::ModelNode& arNode)
+	{
+		BSWARNING(WARN_EDITOR, "Property %s (DataPath: %s) is not editable in the new shader model.", BSString(arNode.GetViewPath()).QString(), QStoredDataPath(arNode));
+
+		if (arNode.QHasDataParent())
+		{
+			BSVERIFY(arNode.SetValue(arNode.GetParentValue()));
+
+			// Report if the value is an Object and is non null. It is supposed to be zeroed out as parent should not have layers/Blenders by default.
+			BSComponentDB2::ID id;
+			BSWARNING_IF(arNode.Get(id) && id != BSComponentDB2::NullIDC, WARN_MATERIALS, "We copied a sub object from our shader model root material");
+		}
+		else
+		{
+			BSReflection::Any theDefault(*arNode.GetDataType());
+			BSVERIFY(arNode.SetNativeValue(theDefault.MakePointer()));
+		}
+	}
+
+	/// <summary> Build the unprocessed Model Node hierarchy of a Material, with every property whatever its Shader Model shows. </summary>
+	/// <param name="aMaterial"> The material. </param>
+	/// <param name="arRootNode"> OUT: Root of the hierarchy. </param>
+	void BuildMaterialHierarchy(BSMaterial::LayeredMaterialID aMaterial, QtPropertyEditor::ModelNode& arRootNode)
+	{
+		QtPropertyEditor::GenericEditorBuilder visitor(arRootNode);
+		visitor.Visit(BSReflection::ObjectPtr(&aMaterial));
+	}
+
+	/// <summary> Layered material slot properties, by slot ID type. </summary>
+	template <typename SlotID>
+	struct LayeredMaterialSlotTraits;
+
+	template <>
+	struct LayeredMaterialSlotTraits<BSMaterial::LayerID>
+	{
+		static constexpr uint32_t CountC = BSMaterial::MaxLayerCountC;
+		static constexpr char pNameFormatC[] = { "Layer%u" };
+		static BSMaterial::LayerID Get(BSMaterial::LayeredMaterialID aMaterial, uint32_t aIndex) { return BSMaterial::GetLayer(aMaterial, static_cast<uint8_t>(aIndex)); }
+	};
+
+	template <>
+	struct LayeredMaterialSlotTraits<BSMaterial::BlenderID>
+	{
+		static constexpr uint32_t CountC = BSMaterial::MaxBlenderCountC;
+		static constexpr char pNameFormatC[] = { "Blender%u" };
+		static BSMaterial::BlenderID Get(BSMaterial::LayeredMaterialID aMaterial, uint32_t aIndex) { return BSMaterial::GetBlender(aMaterial, static_cast<uint8_t>(aIndex)); }
+	};
+
+	/// <summary> Get the interned property names of the layered material slots of a type. </summary>
+	/// <returns> One name per slot, "Layer1" being the first layer slot. </returns>
+	template <typename SlotID>
+	const std::array<BSFixedString, LayeredMaterialSlotTraits<SlotID>::CountC>& QLayeredMaterialSlotNames()
+	{
+		static const std::array<BSFixedString, LayeredMaterialSlotTraits<SlotID>::CountC> names = []()
+		{
+			std::array<BSFixedString, LayeredMaterialSlotTraits<SlotID>::CountC> slotNames;
+			for (uint32_t i = 0; i < slotNames.size(); ++i)
+			{
+				BSString name;
+				name.Format(LayeredMaterialSlotTraits<SlotID>::pNameFormatC, i + 1);
+				slotNames[i] = BSFixedString(name.QString());
+			}
+			return slotNames;
+		}();
+		return names;
+	}
+
+	/// <summary> Count the slots of a type the Shader Model rules leave visible on a layered material. </summary>
+	/// <param name="aMaterial"> The layered material. </param>
+	/// <param name="apRules"> Compiled layered material rules, null if every slot is visible. </param>
+	/// <param name="arState"> IN/OUT: State to add the counts to. </param>
+	template <typename SlotID>
+	void CountLayeredMaterialSlots(BSMaterial::LayeredMaterialID aMaterial, const CompiledClassRules* apRules, SharedTools::ShaderModelState& arState)
+	{
+		using Traits = LayeredMaterialSlotTraits<SlotID>;
+		const auto& rslotNames = QLayeredMaterialSlotNames<SlotID>();
+
+		for (uint32_t i = 0; i < Traits::CountC; ++i)
+		{
+			if (apRules == nullptr || !apRules->IsRemoved(rslotNames[i]))
+			{
+				if constexpr (std::is_same_v<SlotID, BSMaterial::LayerID>)
+				{
+					arState.LayerCount++;
+					if (Traits::Get(aMaterial, i).QValid())
+					{
+						arState.LayersInUse++;
+					}
+				}
+				else
+				{
+					arState.BlenderCount++;
+				}
+			}
+		}
+	}
 }
 
 /// --------------------------------------------------------------------------------
@@ -162,6 +713,7 @@ namespace SharedTools
 						newMetaDataObj[ShaderModelMetaRootMaterialC] = aOutShaderModelName.QString();
 						newShaderModelJson[TemplateManager::pJson_TemplateMetaDataC] = newMetaDataObj;
 						TemplateManager::QInstance().SaveTemplateToFile(ShaderModelsTemplateCategoryC, aOutShaderModelName.QString(), aOutShaderModelFileName.QString());
+						InvalidateShaderModelInfoTable();
 
 						// Add new Json SM file to perforce if you mapped Data/EditorFiles/... in your P4 data workspace folder.
 						BSPerforce::ConnectionSmartPtr spperforce;
@@ -226,81 +778,120 @@ namespace SharedTools
 			});
 	}
 
+	/// <summary>
+	/// Calculate ShaderModel State directly from the layered material slots and the compiled Shader Model rules, without a property tree.
+	/// </summary>
+	/// <param name="aMaterial"> The layered material. </param>
+	/// <param name="aShaderModelName"> Shader Model applied to the material, empty if none is applied (root materials). </param>
+	/// <param name="arState"> OUT: Calculated state </param>
+	/// <returns> False if the Shader Model rules are not compiled, the state must then be calculated from the processed property tree. </returns>
+	bool CalculateShaderModelState(BSMaterial::LayeredMaterialID aMaterial, const BSFixedString& aShaderModelName, ShaderModelState& arState)
+	{
+		arState = { 0 };
+
+		// A Shader Model that is not applied (unknown template) leaves every slot visible, like in the property editor.
+		const ShaderModelInfo* pinfo = FindShaderModelInfo(aShaderModelName);
+		const bool canCalculate = pinfo == nullptr || pinfo->RulesCompiled;
+		if (canCalculate)
+		{
+			const CompiledClassRules* prules = nullptr;
+			if (pinfo != nullptr)
+			{
+				const ShaderModelInfoTable& rtable = QBuiltShaderModelInfoTable();
+				auto iter = rtable.LayeredMaterialRules.find(aShaderModelName);
+				prules = iter != rtable.LayeredMaterialRules.end() ? iter->second.get() : nullptr;
+			}
+
+			CountLayeredMaterialSlots<BSMaterial::LayerID>(aMaterial, prules, arState);
+			CountLayeredMaterialSlots<BSMaterial::BlenderID>(aMaterial, prules, arState);
+		}
+		return canCalculate;
+	}
+
 	/// <summary> Migrate visible properties of the new material that has just been switched to a new Shader Model parent. </summary>
 	/// <param name="arMaterialPropertyEditorRootNode"> The first node to Material loaded in the Tool Property Editor </param>
 	/// <param name="aShaderModelRootMaterial"> The new Shader Model Root Material to migrate to</param>
 	void MigrateShaderModelProperties(QtPropertyEditor::ModelNode& arMaterialPropertyEditorRootNode,
 		BSMaterial::LayeredMaterialID aShaderModelRootMaterial)
 	{
-		using namespace QtPropertyEditor;
-
-		auto applyProcessors = [](ModelNode& arNode, const BSFixedString& aShaderModelToApply) {
-
-			DeleteProcessor cleanupProcessor; // Mandatory last processor
-
-			// Try to find the shader model processor and apply it on Model Node hierarchy.
-			std::shared_ptr<RuleProcessor> shaderModelProcessor = SharedTools::GetShaderModelRuleProcessor(aShaderModelToApply);
-			BSASSERT(shaderModelProcessor != nullptr, "SwitchShaderModel : Cannot find shader model (%s) processor.", aShaderModelToApply.QString());
-			shaderModelProcessor->Process(arNode);
+		// Iterate the source model node properties and test their data path against the properties visible in the destination
+		// Shader Model. If a property cannot carry over, revert it to data parent value (default), else leave the property intact.
+		const ShaderModelPropertyMask& rmask = QShaderModelPropertyMask(aShaderModelRootMaterial);
+		ForEachPropertyToRevert(arMaterialPropertyEditorRootNode, rmask, QShaderModelPropertyMaskCache().DataPaths, &RevertMigratedProperty);
+	}
 
-			// Apply node clean up (delete) as last processor, processing nodes that were set to hidden.
-			cleanupProcessor.Process(arNode);
-		};
+	/// <summary>
+	/// Dry run of MigrateMaterialsToShaderModel, listing the properties a switch would revert without modifying anything.
+	/// Walks the same unprocessed hierarchy as the migration, not the property editor tree the current Shader Model already pruned.
+	/// </summary>
+	/// <param name="aMaterial"> The Material to switch. </param>
+	/// <param name="aShaderModelRootMaterial"> The Shader Model Root Material to migrate to</param>
+	/// <param name="arRevertedProperties"> OUT: View path of the properties that would be reverted. </param>
+	void ReportShaderModelMigration(BSMaterial::LayeredMaterialID aMaterial, BSMaterial::LayeredMaterialID aShaderModelRootMaterial, stl::vector<BSString>& arRevertedProperties)
+	{
+		arRevertedProperties.clear();
+		const ShaderModelPropertyMask& rmask = QShaderModelPropertyMask(aShaderModelRootMaterial);
+		QtPropertyEditor::ModelNode rootNode;
+		BuildMaterialHierarchy(aMaterial, rootNode);
+		ForEachPropertyToRevert(rootNode, rmask, QShaderModelPropertyMaskCache().DataPaths, [&arRevertedProperties](QtPropertyEditor::ModelNode& arChild)
+		{
+			arRevertedProperties.emplace_back(arChild.GetViewPath());
+		});
+	}
 
-		// Create Model Node hierarchy for Destination Material with Shader Model to compare against.
-		ModelNode destRootNode;
-		GenericEditorBuilder destVisitor(destRootNode);
-		destVisitor.Visit(BSReflection::ObjectPtr(&aShaderModelRootMaterial));
-		BSMaterial::ShaderModelComponent destSMComponent = BSMaterial::GetLayeredMaterialShaderModel(aShaderModelRootMaterial);
-		applyProcessors(destRootNode, destSMComponent.FileName);
+	/// <summary>
+	/// Switch a batch of Materials to a Shader Model without any UI. The destination properties are computed once and shared,
+	/// then each Material is migrated on its own unprocessed Model Node hierarchy. All results are saved together.
+	/// </summary>
+	/// <param name="aMaterials"> Materials to switch and migrate. </param>
+	/// <param name="aShaderModelRootMaterial"> The Shader Model Root Material to migrate to. </param>
+	/// <param name="aDependentMaterials"> Additional materials affected by the switch (data children) to save with the batch. </param>
+	/// <returns> True if all the materials were saved. </returns>
+	bool MigrateMaterialsToShaderModel(const BSTArray<BSMaterial::LayeredMaterialID>& aMaterials, BSMaterial::LayeredMaterialID aShaderModelRootMaterial,
+		const BSTArray<BSMaterial::LayeredMaterialID>& aDependentMaterials)
+	{
+		using namespace QtPropertyEditor;
 
-		// iterate the source model node visible properties after processors have been applied. Find their equivalent dataPath properties
-		// in simulated destination Material visible properties. If a data path is not found, revert the property to data parent value (default), 
-		// else leave the property intact.
-		arMaterialPropertyEditorRootNode.ForEach([&destRootNode](ModelNode& arChild) {
+		// Build the destination properties once, every material is compared against the same mask and data path table.
+		const ShaderModelPropertyMask& rmask = QShaderModelPropertyMask(aShaderModelRootMaterial);
+		const DataPathTable& rdataPaths = QShaderModelPropertyMaskCache().DataPaths;
 
-			BSContainer::ForEachResult result = BSContainer::Continue;
+		for (BSMaterial::LayeredMaterialID material : aMaterials)
+		{
+			BSMaterial::ChangeShaderModel(material, aShaderModelRootMaterial);
+		}
+		// The new data parents must be committed so reverted properties pick up the new root material values.
+		BSMaterial::Flush();
 
-			bool propertyIsValid = false;
-			BSString displayedPropertyName(arChild.GetViewPath());
-			BSString srcPropertyDataPath(arChild.GetDataPath());
-			// Process all properties except root which is the LayeredMaterial ID document.
-			if (!srcPropertyDataPath.IsEmpty())
-			{
-				ModelNode* pnodeInDestination = destRootNode.FindDataPath(srcPropertyDataPath.QString());
-				if (pnodeInDestination)
-				{
-					propertyIsValid = pnodeInDestination->QState() != ModelNode::ReadOnly;
-					BSWARNING(WARN_EDITOR, "Property %s (DataPath: %s) found and can be migrated", displayedPropertyName.QString(), srcPropertyDataPath.QString());
-				}
-				else
-				{
-					// Skip children if node is not found.
-					result = BSContainer::SkipChildren;
-				}
+		// Reverting writes the material DB, so the materials are migrated one after the other.
+		for (BSMaterial::LayeredMaterialID material : aMaterials)
+		{
+			// Full hierarchy without processors, the mask already tells what the destination Shader Model shows.
+			ModelNode rootNode;
+			BuildMaterialHierarchy(material, rootNode);
+			ForEachPropertyToRevert(rootNode, rmask, rdataPaths, &RevertMigratedProperty);
+		}
 
-				// Revert invalid properties to new parents default value.
-				if (!propertyIsValid)
-				{
-					BSWARNING(WARN_EDITOR, "Property %s (DataPath: %s) is not editable in the new shader model.", displayedPropertyName.QString(), srcPropertyDataPath.QString());
+		// Save the switched materials and the ones depending on them as one group.
+		BSTArray<BSMaterial::LayeredMaterialID> materialsToSave(aMaterials);
+		for (BSMaterial::LayeredMaterialID material : aDependentMaterials)
+		{
+			materialsToSave.Add(material);
+		}
+		return BSMaterial::Save(materialsToSave);
+	}
 
-					if (arChild.QHasDataParent())
-					{
-						BSVERIFY(arChild.SetValue(arChild.GetParentValue()));
+	/// <summary> Discard the cached properties of a Shader Model root material, to call when the root material is modified. </summary>
+	/// <param name="aShaderModelRootMaterial"> The modified Shader Model Root Material. </param>
+	void InvalidateShaderModelPropertyMask(BSMaterial::LayeredMaterialID aShaderModelRootMaterial)
+	{
+		QShaderModelPropertyMaskCache().Masks.erase(aShaderModelRootMaterial.QID().QValue());
+	}
 
-						// Report if the value is an Object and is non null. It is supposed to be zeroed out as parent should not have layers/Blenders by default.
-						BSComponentDB2::ID id;
-						BSWARNING_IF(arChild.Get(id) && id != BSComponentDB2::NullIDC, WARN_MATERIALS, "We copied a sub object from our shader model root material");
-					}
-					else
-					{
-						BSReflection::Any theDefault(*arChild.GetDataType());
-						BSVERIFY(arChild.SetNativeValue(theDefault.MakePointer()));
-					}
-				}
-			}
-			return result;
-			});
+	/// <summary> Discard the cached properties of every Shader Model root material, to call when materials are reloaded. </summary>
+	void InvalidateShaderModelPropertyMasks()
+	{
+		QShaderModelPropertyMaskCache().Masks.clear();
 	}
 
 	/// <summary> Is ShaderModel of Material classified as a Base Material ? </summary>
@@ -366,6 +957,14 @@ namespace SharedTools
 		return shaderModels;
 	}
 
+	/// <summary> Test if a name is a loaded ShaderModel template. </summary>
+	/// <param name="aShaderModelName">The name to test.</param>
+	/// <returns> True if a ShaderModel template of that name is loaded. </returns>
+	bool IsShaderModel(const BSFixedString& aShaderModelName)
+	{
+		return FindShaderModelInfo(aShaderModelName) != nullptr;
+	}
+
 	/// <summary> Test if ShaderModel is Locked. This means cannot create new material from root SM material, and full inheritance should be prevented. </summary>
 	/// <param name="aShaderModelName">The shader model name to get the shader root material.</param>
 	/// <returns> Rule processor associated with this ShaderModel </returns>
@@ -374,20 +973,86 @@ namespace SharedTools
 		return QtPropertyEditor::TemplateManager::QInstance().GetRuleProcessor(ShaderModelsTemplateCategoryC, aShaderModelName.QString());
 	}
 
+	/// <summary> Get the processors applying the rules of a ShaderModel, compiled once when the templates are loaded. </summary>
+	/// <param name="aShaderModelName">The shader model name to get the compiled rules.</param>
+	/// <returns> The processors, nullptr if the rules could not be compiled and GetShaderModelRuleProcessor must be used instead. </returns>
+	const ShaderModelProcessorList* GetShaderModelCompiledRules(const BSFixedString& aShaderModelName)
+	{
+		const ShaderModelInfo* pinfo = FindShaderModelInfo(aShaderModelName);
+		return pinfo != nullptr && pinfo->RulesCompiled ? &pinfo->CompiledRules : nullptr;
+	}
+
+	/// <summary> Apply the rules of a ShaderModel on a Model Node hierarchy, using the compiled rules when available. </summary>
+	/// <param name="arRootNode">The root of the hierarchy to process.</param>
+	/// <param name="aShaderModelName">The shader model name to apply.</param>
+	void ApplyShaderModelRules(QtPropertyEditor::ModelNode& arRootNode, const BSFixedString& aShaderModelName)
+	{
+		const ShaderModelProcessorList* pcompiledRules = GetShaderModelCompiledRules(aShaderModelName);
+		if (pcompiledRules != nullptr)
+		{
+			for (const auto& rspprocessor : *pcompiledRules)
+			{
+				rspprocessor->Process(arRootNode);
+			}
+		}
+		else
+		{
+			std::shared_ptr<QtPropertyEditor::RuleProcessor> shaderModelProcessor = GetShaderModelRuleProcessor(aShaderModelName);
+			BSASSERT(shaderModelProcessor != nullptr, "Cannot find shader model (%s) processor.", aShaderModelName.QString());
+			if (shaderModelProcessor)
+			{
+				shaderModelProcessor->Process(arRootNode);
+			}
+		}
+	}
+
+	/// <summary> Find the compiled metadata of a Shader Model. The table is built once and only rebuilt after InvalidateShaderModelInfoTable. </summary>
+	/// <param name="aShaderModelName">The shader model name to look up.</param>
+	/// <returns> The Shader Model metadata, nullptr if there is no template with that name. </returns>
+	const ShaderModelInfo* FindShaderModelInfo(const BSFixedString& aShaderModelName)
+	{
+		const ShaderModelInfo* pinfo = nullptr;
+		if (!aShaderModelName.QEmpty())
+		{
+			const ShaderModelInfoTable& rtable = QBuiltShaderModelInfoTable();
+			auto iter = rtable.Infos.find(aShaderModelName);
+			if (iter != rtable.Infos.end())
+			{
+				pinfo = &iter->second;
+			}
+		}
+		return pinfo;
+	}
+
+	/// <summary> Flag the Shader Model metadata table as outdated, to call when the Shader Model templates are modified or reloaded. </summary>
+	void InvalidateShaderModelInfoTable()
+	{
+		ShaderModelInfoTable& rtable = QShaderModelInfoTable();
+		rtable.Built = false;
+		++rtable.Revision;
+	}
+
+	/// <summary> Get the revision of the loaded Shader Model templates, so dependent caches can detect a template reload. </summary>
+	/// <returns> Revision number, incremented on each InvalidateShaderModelInfoTable. </returns>
+	uint32_t QShaderModelTemplateRevision()
+	{
+		return QShaderModelInfoTable().Revision;
+	}
+
 	/// <summary> Get the ShaderModel metadata tag that links to a root material. </summary>
 	/// <param name="aShaderModelName">The shader model name to get the shader root material.</param>
 	/// <returns> Root material name </returns>
 	BSFixedString GetShaderModelRootMaterial(const BSFixedString& aShaderModelName)
 	{
 		// Empty shader model/not found defaults to Experimental shader model.
-		std::string rootMaterialName(DefaultShaderModelC);
+		BSFixedString rootMaterialName(DefaultShaderModelC);
 		if (!aShaderModelName.QEmpty())
 		{
-			rootMaterialName = QtPropertyEditor::TemplateManager::QInstance().GetMetaDataValue<std::string>(ShaderModelsTemplateCategoryC,
-				aShaderModelName.QString(), ShaderModelMetaRootMaterialC);
+			const ShaderModelInfo* pinfo = FindShaderModelInfo(aShaderModelName);
+			rootMaterialName = pinfo != nullptr ? pinfo->RootMaterial : BSFixedString();
 		}
 
-		return BSFixedString(rootMaterialName.c_str());
+		return rootMaterialName;
 	}
 
 	/// <summary> Set ShaderModel RootMaterial Metadata </summary>
@@ -397,6 +1062,7 @@ namespace SharedTools
 	{
 		BSVERIFY(QtPropertyEditor::TemplateManager::QInstance().SetMetaDataValue(ShaderModelsTemplateCategoryC, aShaderModelName.QString(),
 			ShaderModelMetaRootMaterialC, std::string(aRootMaterialName.QString())));
+		InvalidateShaderModelInfoTable();
 	}
 
 	/// <summary> Test if ShaderModel is Locked. This means cannot create new material from root SM material, and full inheritance should be prevented. </summary>
@@ -412,7 +1078,8 @@ namespace SharedTools
 		{
 			if (!aShaderModelName.QEmpty())
 			{
-				isLocked = QtPropertyEditor::TemplateManager::QInstance().GetMetaDataValue<bool>(ShaderModelsTemplateCategoryC, aShaderModelName.QString(), ShaderModelMetaLockedC);
+				const ShaderModelInfo* pinfo = FindShaderModelInfo(aShaderModelName);
+				isLocked = pinfo != nullptr && pinfo->Locked;
 			}
 			else
 			{
@@ -435,9 +1102,10 @@ namespace SharedTools
 		const bool isSuperUser = bMaterialSuperUser.Bool();
 		if (!isSuperUser)
 		{
-			if (!aShaderModelName.QEmpty())
+			const ShaderModelInfo* pinfo = FindShaderModelInfo(aShaderModelName);
+			if (pinfo != nullptr)
 			{
-				isSwitchable = QtPropertyEditor::TemplateManager::QInstance().GetMetaDataValue<bool>(ShaderModelsTemplateCategoryC, aShaderModelName.QString(), ShaderModelMetaSwitchableC, true);
+				isSwitchable = pinfo->Switchable;
 			}
 		}
 		return isSwitchable;
@@ -448,54 +1116,20 @@ namespace SharedTools
 	/// <returns> DisplayName if any. Otherwise Shader Model Name. </returns>
 	BSFixedString GetShaderModelDisplayName(const BSFixedString& aShaderModelName)
 	{
-		const char* pdisplayName = nullptr;
-		std::string displayNameMeta = QtPropertyEditor::TemplateManager::QInstance().GetMetaDataValue<std::string>(ShaderModelsTemplateCategoryC, aShaderModelName.QString(), ShaderModelMetaDisplayNameC);
-		if (displayNameMeta.empty())
-		{
-			// There are no display name alias, just re-use the name for the UI.
-			pdisplayName = aShaderModelName.QString();
-		}
-		else
-		{
-			pdisplayName = displayNameMeta.c_str();
-		}
-		return BSFixedString(pdisplayName);
+		const ShaderModelInfo* pinfo = FindShaderModelInfo(aShaderModelName);
+		return pinfo != nullptr ? pinfo->DisplayName : aShaderModelName;
 	}
 
-	/// <summary> 
-	/// Get a Map of ShaderModel DisplayName Alias to use in the UI instead of the data name. 
-	/// If no Display Name is present, we simply default to present the name of the Shader Model.
-	/// </summary>
-	/// <param name="arDisplayNameMap">OUT : Map of Name to DisplayNames</param>
-	void GetShaderModelDisplayNameMap(stl::scrap_unordered_map<BSFixedString, BSFixedString>& arDisplayNameMap)
-	{
-		arDisplayNameMap.clear();
-		stl::vector<std::string> shaderModels = GetShaderModelTemplateList();
-		for (const auto& shaderModelName : shaderModels)
-		{
-			BSFixedString name(shaderModelName.c_str());
-			arDisplayNameMap[name] = GetShaderModelDisplayName(name);
-		}
-	}
-
-	/// <summary> Utility function to resolve to the corresponding ShaderModel from DisplayNameMap (see GetShaderModelDisplayNameMap). </summary>
+	/// <summary> Resolve a Display Name to the corresponding ShaderModel name using the persistent display name index. </summary>
 	/// <param name="aDisplayName"> Display Name to resolve to ShaderModel Name.</param>
-	/// <returns> Corresponding ShaderModel Name. </returns>
-	const BSFixedString ResolveShaderModelDisplayName(const BSFixedString& aDisplayName, const stl::scrap_unordered_map<BSFixedString, BSFixedString>& aDisplayNameMap)
+	/// <returns> Corresponding ShaderModel Name, empty if the Display Name is unknown. </returns>
+	const BSFixedString& ResolveShaderModelDisplayName(const BSFixedString& aDisplayName)
 	{
-		const char* pfound = nullptr;
-		stl::vector<std::string> shaderModels = GetShaderModelTemplateList();
-		for (const auto& rentry : aDisplayNameMap)
-		{
-			if (rentry.second.Compare(aDisplayName) == 0)
-			{
-				// We want the key (Shader Model name)
-				pfound = rentry.first.QString();
-				break;
-			}
-		}
-		BSASSERT(pfound != nullptr, "You have supplied a DisplayName that cannot be resolved to ShaderModel name. This should never happen.");
-		return BSFixedString(pfound);
+		static const BSFixedString EmptyNameC;
+
+		const ShaderModelInfoTable& rtable = QBuiltShaderModelInfoTable();
+		auto iter = rtable.DisplayNameToName.find(aDisplayName);
+		return iter != rtable.DisplayNameToName.end() ? iter->second : EmptyNameC;
 	}
 
 	/// <summary> Test if ShaderModel uses LOD materials. </summary>
@@ -503,18 +1137,8 @@ namespace SharedTools
 	/// <returns> True if LODs are enabled. </returns>
 	bool GetShaderModelUsesLevelOfDetail(const BSFixedString& aShaderModelName)
 	{
-		bool enabled = true;
-		if (!aShaderModelName.QEmpty())
-		{			
-			enabled = 
-				!QtPropertyEditor::TemplateManager::QInstance().GetMetaDataValue<bool>
-				(
-					ShaderModelsTemplateCategoryC,
-					aShaderModelName.QString(),
-					ShaderModelMetaDisableLOD
-				);
-		}
-		return enabled;
+		const ShaderModelInfo* pinfo = FindShaderModelInfo(aShaderModelName);
+		return pinfo == nullptr || pinfo->UsesLevelOfDetail;
 	}
 
 }
\ No newline at end of file
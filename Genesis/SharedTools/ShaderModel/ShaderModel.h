@@ -24,6 +24,7 @@
 
 #include <BSMaterial/BSMaterialFwd.h>
 #include <BSSystem/BSFixedString.h>
+#include <SharedTools/Qt/Widgets/PropertyEditor/CustomUIProcessor.h>
 #include <SharedTools/Qt/Widgets/PropertyEditor/GenericEditorBuilder.h>
 #include <SharedTools/Qt/Widgets/PropertyEditor/RuleProcessor.h>
 
@@ -44,6 +45,22 @@ namespace SharedTools
 		uint16_t BlenderCount = 0;
 	};
 
+	/// <summary> Processors applying the compiled rules of a Shader Model template, one per rule class. </summary>
+	using ShaderModelProcessorList = stl::vector<std::shared_ptr<QtPropertyEditor::CustomUIProcessor>>;
+
+	/// <summary> Shader Model template metadata, compiled once from the rule templates. </summary>
+	struct ShaderModelInfo
+	{
+		BSFixedString Name;
+		BSFixedString RootMaterial;
+		BSFixedString DisplayName;
+		bool Locked = false;			// Raw metadata value, super user override is applied by GetShaderModelLocked.
+		bool Switchable = true;			// Raw metadata value, super user override is applied by GetShaderModelSwitchable.
+		bool UsesLevelOfDetail = true;
+		bool RulesCompiled = false;		// If false, the template rules must be interpreted by its RuleProcessor.
+		ShaderModelProcessorList CompiledRules;
+	};
+
 	// ShaderModel Utilities
 	bool IsBaseMaterial(BSMaterial::LayeredMaterialID aMaterialID);
 	bool IsExperimental(const BSFixedString& aShaderModelName);
@@ -51,19 +68,29 @@ namespace SharedTools
 	BSFilePathString GetShaderModelWatchFolder();
 	bool CreateNewShaderModel(QWidget* apParent, BSFixedString& aOutShaderModelName, BSFixedString& aOutShaderModelFileName, BSMaterial::LayeredMaterialID& aOutCreatedRootMaterial);
 	void CalculateShaderModelState(QtPropertyEditor::ModelNode& arMaterialPropertyEditorRootNode, ShaderModelState& arState);
+	bool CalculateShaderModelState(BSMaterial::LayeredMaterialID aMaterial, const BSFixedString& aShaderModelName, ShaderModelState& arState);
 	void MigrateShaderModelProperties(QtPropertyEditor::ModelNode& arMaterialPropertyEditorRootNode, BSMaterial::LayeredMaterialID aShaderModelRootMaterial);
+	bool MigrateMaterialsToShaderModel(const BSTArray<BSMaterial::LayeredMaterialID>& aMaterials, BSMaterial::LayeredMaterialID aShaderModelRootMaterial, const BSTArray<BSMaterial::LayeredMaterialID>& aDependentMaterials);
+	void ReportShaderModelMigration(BSMaterial::LayeredMaterialID aMaterial, BSMaterial::LayeredMaterialID aShaderModelRootMaterial, stl::vector<BSString>& arRevertedProperties);
+	void InvalidateShaderModelPropertyMask(BSMaterial::LayeredMaterialID aShaderModelRootMaterial);
+	void InvalidateShaderModelPropertyMasks();
 	void SaveShaderModelToFile(const BSFixedString& aShaderModelAbsoluteFilePath);
 	stl::vector<std::string> GetShaderModelTemplateList();
+	bool IsShaderModel(const BSFixedString& aShaderModelName);
 	std::shared_ptr<QtPropertyEditor::RuleProcessor> GetShaderModelRuleProcessor(const BSFixedString& aShaderModelName);
+	const ShaderModelProcessorList* GetShaderModelCompiledRules(const BSFixedString& aShaderModelName);
+	void ApplyShaderModelRules(QtPropertyEditor::ModelNode& arRootNode, const BSFixedString& aShaderModelName);
 
 	// ShaderModel metadata utilities
+	const ShaderModelInfo* FindShaderModelInfo(const BSFixedString& aShaderModelName);
+	void InvalidateShaderModelInfoTable();
+	uint32_t QShaderModelTemplateRevision();
 	BSFixedString GetShaderModelRootMaterial(const BSFixedString& aShaderModelName);
 	void SetShaderModelRootMaterial(const BSFixedString& aShaderModelName, const BSFixedString& aRootMaterialName);
 	bool GetShaderModelLocked(const BSFixedString& aShaderModelName);
 	bool GetShaderModelSwitchable(const BSFixedString& aShaderModelName);
 	BSFixedString GetShaderModelDisplayName(const BSFixedString& aShaderModelName);
-	void GetShaderModelDisplayNameMap(stl::scrap_unordered_map<BSFixedString, BSFixedString>& arDisplayNames);
-	const BSFixedString ResolveShaderModelDisplayName(const BSFixedString& aDisplayName, const stl::scrap_unordered_map<BSFixedString, BSFixedString>& aDisplayNameMap);
+	const BSFixedString& ResolveShaderModelDisplayName(const BSFixedString& aDisplayName);
 	bool GetShaderModelUsesLevelOfDetail(const BSFixedString& aShaderModelName);
 
 	void CopyAndSwitchMaterial(BSMaterial::LayeredMaterialID aSrcMaterialId, BSMaterial::LayeredMaterialID aShaderModelRootMaterialId, const BSFixedString& aDestMaterialFilePath);